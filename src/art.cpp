@@ -1,33 +1,460 @@
 #include "art.hpp"
 
+#include "swar.hpp"
+
 #include <iostream>
 #include <sstream>
 #include <iterator>
+#include <algorithm>
 #include "immintrin.h"
 
-uint8_t Node::indexOfChildLastAccessed = 0;
-
-// TODO: implement if needed
-ART::ART() = default;
+ART::ART() : profiler(Profiler::fromEnvironment()) {}
 
-// TODO: implement if needed
-ART::~ART() = default;
+ART::~ART() {
+    if (profiler) {
+        profiler->writeConfiguredOutput();
+    }
+    // the rest of the nodes is never freed, only the leaf blocks of insert_batch are owned by the tree
+    for (auto const &[leaves, count]: leafBlocks) {
+        NodeAllocator::deallocate(leaves, count * sizeof(LeafNode));
+    }
+}
 
 Value ART::lookup(const Key &key) {
+    if (profiler) [[unlikely]] {
+        if (auto *sample = profiler->begin(Profiler::Operation::Lookup)) {
+            // always walks the tree, a hit in the side table would not tell anything about the levels
+            auto *leaf = lookupLeaf(key, sample);
+            profiler->end(sample);
+            if (cache) {
+                recordAccess(leaf);
+            }
+            return leaf != nullptr ? leaf->getValue() : INVALID_VALUE;
+        }
+    }
+
+    if (!fingerprints && !cache) {
+        auto *leaf = lookupLeaf(key);
+        return leaf != nullptr ? leaf->getValue() : INVALID_VALUE;
+    }
+
+    auto *leaf = fingerprints ? fingerprints->find(key) : nullptr;
+    if (leaf == nullptr) {
+        leaf = lookupLeaf(key);
+        // miss in the side table -> remember the leaf, so hot keys stay in the table
+        if (leaf != nullptr && fingerprints) {
+            fingerprints->insert(key, leaf);
+        }
+    }
+    if (cache) {
+        recordAccess(leaf);
+    }
+    return leaf != nullptr ? leaf->getValue() : INVALID_VALUE;
+}
+
+// offsets of the byte indexed arrays of node256 and node48, taken from real nodes once (offsetof is not defined for
+// classes with virtual functions)
+static const std::ptrdiff_t NODE256_CHILDREN_OFFSET = [] {
+    Node256 node;
+    return reinterpret_cast<const std::byte *>(node.children.data()) - reinterpret_cast<const std::byte *>(&node);
+}();
+static const std::ptrdiff_t NODE48_KEYS_OFFSET = [] {
+    Node48 node;
+    return reinterpret_cast<const std::byte *>(node.keys.data()) - reinterpret_cast<const std::byte *>(&node);
+}();
+
+/**
+ * Starts loading the line of `node` that a node48 or node256 reads for `nextByte` (the keys entry, or the child slot).
+ * It lies at a byte dependent offset, usually not on the header line, so without this it is a second cache miss after
+ * the header. The type is only known once the header is there, so both candidates are requested. `nextByte` is a
+ * guess that assumes the node has no prefix, which holds for the dense levels where node256s and node48s show up.
+ */
+static void prefetchChildSlot(const Node *node, uint8_t nextByte) {
+    auto const *base = reinterpret_cast<const std::byte *>(node);
+    __builtin_prefetch(base + NODE256_CHILDREN_OFFSET + nextByte * sizeof(Node *));
+    __builtin_prefetch(base + NODE48_KEYS_OFFSET + nextByte);
+}
+
+Value ART::lookup(const Key &key, LookupCursor &cursor) {
+    if (cursor.tree != this || cursor.structureVersion != structureVersion) {
+        cursor.tree = this;
+        cursor.structureVersion = structureVersion;
+        cursor.pathLength = 0;
+    }
+
+    // number of leading bytes the key shares with the previous one
+    uint64_t previous, current;
+    std::memcpy(&previous, cursor.lastKey.key.data(), sizeof(previous));
+    std::memcpy(&current, key.key.data(), sizeof(current));
+    auto const difference = __builtin_bswap64(previous ^ current);
+    uint8_t const commonBytes = std::min<uint8_t>(difference == 0 ? 8 : __builtin_clzll(difference) / 8,
+                                                  std::min(key.key_len, cursor.lastKey.key_len));
+
+    // a cached node is reached by the bytes before its depth only (prefixes are skipped optimistically in lookup)
+    uint8_t reused = 0;
+    while (reused < cursor.pathLength && cursor.path[reused].depth <= commonBytes) {
+        reused++;
+    }
+    cursor.levelsSkipped += reused > 0 ? reused - 1 : 0;
+
     Node *node = root;
     uint8_t depth = 0;
+    if (reused > 0) {
+        node = cursor.path[reused - 1].node;
+        depth = cursor.path[reused - 1].depth;
+        reused--;
+    }
+    cursor.pathLength = reused;
+    cursor.lastKey = key;
+
+    while (node != nullptr) {
+        if (node->isLeafNode) {
+            auto *leaf = dynamic_cast<LeafNode *>(node);
+            if (leaf->key != key) {
+                break;
+            }
+            if (cache) {
+                recordAccess(leaf);
+            }
+            return leaf->getValue();
+        }
+
+        cursor.path[cursor.pathLength++] = {node, depth};
+        depth = depth + node->prefixLength + 1;
+        if (depth > key.key_len) {
+            break;
+        }
+        node = node->getChildren(key[depth - 1]);
+        if (node != nullptr && depth < key.key_len) {
+            prefetchChildSlot(node, key[depth]);
+        }
+    }
+    if (cache) {
+        recordAccess(nullptr);
+    }
+    return INVALID_VALUE;
+}
+
+LookupTask ART::lookup_async(Key key) {
+    if (fingerprints) {
+        if (auto *cached = fingerprints->find(key)) {
+            if (cache) {
+                recordAccess(cached);
+            }
+            co_return cached->getValue();
+        }
+    }
+
+    Node *node = root;
+    uint8_t depth = 0;
+    auto version = structureVersion;
+    co_await PrefetchAwaiter{node};
 
     while (true) {
+        if (version != structureVersion) {
+            // the tree changed while we were suspended, `node` may have been replaced and freed
+            node = root;
+            depth = 0;
+            version = structureVersion;
+        }
         if (node == nullptr) {
-            return INVALID_VALUE;
+            break;
+        }
+        if (node->isLeafNode) {
+            auto *leaf = dynamic_cast<LeafNode *>(node);
+            if (leaf->key != key) {
+                break;
+            }
+            if (cache) {
+                recordAccess(leaf);
+            }
+            co_return leaf->getValue();
+        }
+
+        depth = depth + node->prefixLength + 1;
+        if (depth > key.key_len) {
+            break;
+        }
+        node = node->getChildren(key[depth - 1]);
+        // the child is not needed before the next resume, let the other lookups run meanwhile
+        co_await PrefetchAwaiter{node};
+    }
+    if (cache) {
+        recordAccess(nullptr);
+    }
+    co_return INVALID_VALUE;
+}
+
+void ART::enableFingerprintTable(std::size_t budgetBytes) {
+    fingerprints = std::make_unique<FingerprintTable>(budgetBytes);
+}
+
+bool ART::enableCacheMode(std::size_t budgetBytes) {
+    if (root != nullptr || cache || versioned) {
+        return false;
+    }
+    cache = std::make_unique<Cache>();
+    cache->budgetBytes = budgetBytes;
+    return true;
+}
+
+CacheStats ART::cacheStats() const {
+    if (!cache) {
+        return {0, 0, 0, memoryInUse, 0};
+    }
+    CacheStats stats{0, 0, cache->evictions, memoryInUse, cache->budgetBytes};
+    for (auto const &counters: cache->counters) {
+        stats.hits += counters.hits.load(std::memory_order_relaxed);
+        stats.misses += counters.misses.load(std::memory_order_relaxed);
+    }
+    return stats;
+}
+
+std::size_t ART::counterStripe() {
+    static std::atomic<std::size_t> nextStripe{0};
+    static thread_local std::size_t const stripe = nextStripe.fetch_add(1, std::memory_order_relaxed) % Cache::STRIPES;
+    return stripe;
+}
+
+void ART::enableProfiling(uint32_t sampleEvery) {
+    profiler = std::make_unique<Profiler>(sampleEvery);
+}
+
+LeafNode *ART::createLeaf(const Key &key, Value value) {
+    if (cache) {
+        return new CachedLeafNode(key, value);
+    }
+    if (versioned) {
+        // taken before the leaf is linked, so a snapshot may already have it. It cannot scan before the insert is
+        // done though, inserts have the tree exclusively
+        return new VersionedLeafNode(key, value, ++lastCommitTimestamp);
+    }
+    return new LeafNode(key, value);
+}
+
+bool ART::enableVersioning() {
+    if (root != nullptr || cache) {
+        return false;
+    }
+    versioned = true;
+    return true;
+}
+
+void ART::addVersion(VersionedLeafNode *leaf, VersionedLeafNode *current, Node **slot) {
+    if (current->olderVersion == nullptr) {
+        // the key gets its first older version
+        versionChains.push_back(leaf->key);
+    }
+    leaf->olderVersion = current;
+    replaceNode(leaf, slot);
+}
+
+Snapshot ART::snapshot() {
+    std::lock_guard lock{snapshotMutex};
+    auto const timestamp = lastCommitTimestamp.load();
+    activeSnapshots.insert(timestamp);
+    return Snapshot{this, timestamp};
+}
+
+Snapshot::~Snapshot() {
+    if (tree != nullptr) {
+        std::lock_guard lock{tree->snapshotMutex};
+        tree->activeSnapshots.erase(tree->activeSnapshots.find(timestamp));
+    }
+}
+
+std::size_t ART::collectGarbage() {
+    Timestamp oldest;
+    {
+        std::lock_guard lock{snapshotMutex};
+        // snapshots taken from now on get at least the current timestamp
+        oldest = activeSnapshots.empty() ? lastCommitTimestamp.load() : *activeSnapshots.begin();
+    }
+
+    std::size_t freed = 0;
+    for (std::size_t i = 0; i < versionChains.size();) {
+        auto *newest = static_cast<VersionedLeafNode *>(lookupLeaf(versionChains[i]));
+        // every reader sees this version or a newer one, the versions behind it are unreachable
+        auto *keep = newest;
+        while (keep != nullptr && keep->beginTimestamp > oldest) {
+            keep = keep->olderVersion;
+        }
+        if (keep != nullptr) {
+            for (auto *version = std::exchange(keep->olderVersion, nullptr); version != nullptr;) {
+                if (fingerprints) {
+                    // an older version may still be cached if a lookup filled the table before the newer one came
+                    fingerprints->erase(version->key, version);
+                }
+                delete std::exchange(version, version->olderVersion);
+                memoryInUse -= sizeof(VersionedLeafNode);
+                freed++;
+            }
+        }
+        if (newest->olderVersion == nullptr) {
+            versionChains[i] = versionChains.back();
+            versionChains.pop_back();
+        } else {
+            i++;
+        }
+    }
+    return freed;
+}
+
+/** compares the key bytes of a path with the same number of leading bytes of `key` */
+static int comparePath(const std::array<uint8_t, 8> &path, uint8_t length, const Key &key) {
+    if (auto cmp = std::memcmp(path.data(), key.key.data(), std::min(length, key.key_len)); cmp != 0) {
+        return cmp;
+    }
+    // all keys below the path are at least `length` bytes long, so they sort after a shorter key with these bytes
+    return key.key_len < length ? 1 : 0;
+}
+
+void ART::scan(const Key &from, const Key &to, const Snapshot &snapshot, const ScanVisitor &visitor) const {
+    assert(snapshot.tree == this);
+    if (root == nullptr) {
+        return;
+    }
+    std::array<uint8_t, 8> path{};
+    scanNode(root, path, 0, from, to, snapshot.getTimestamp(), visitor);
+}
+
+bool ART::scanNode(const Node *node, std::array<uint8_t, 8> &path, uint8_t depth, const Key &from, const Key &to,
+                   Timestamp readTimestamp, const ScanVisitor &visitor) const {
+    if (node->isLeafNode) {
+        auto const *leaf = dynamic_cast<const LeafNode *>(node);
+        if (compareKeys(leaf->key, to) > 0) {
+            return false;
+        }
+        if (compareKeys(leaf->key, from) < 0) {
+            return true;
+        }
+        if (!versioned) {
+            return visitor(leaf->key, leaf->value);
+        }
+        // keys inserted after the snapshot have no visible version at all
+        auto const *version = static_cast<const VersionedLeafNode *>(leaf)->visibleAt(readTimestamp);
+        return version == nullptr || visitor(version->key, version->value);
+    }
+
+    // prefixes are stored completely, so the path is exact
+    std::memcpy(path.data() + depth, node->prefix.data(), node->prefixLength);
+    auto const branchDepth = static_cast<uint8_t>(depth + node->prefixLength);
+    for (auto const &[partOfKey, child]: childrenInKeyOrder(node)) {
+        path[branchDepth] = partOfKey;
+        auto const length = static_cast<uint8_t>(branchDepth + 1);
+        if (comparePath(path, length, from) < 0) {
+            // the whole subtree is before `from`
+            continue;
+        }
+        if (comparePath(path, length, to) > 0) {
+            return false;
+        }
+        if (!scanNode(child, path, length, from, to, readTimestamp, visitor)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void ART::evictOverBudget() {
+    auto &clock = cache->clock;
+    while (memoryInUse > cache->budgetBytes && !clock.empty()) {
+        if (cache->hand >= clock.size()) {
+            cache->hand = 0;
+        }
+        auto *leaf = clock[cache->hand];
+        if (leaf->referenced.load(std::memory_order_relaxed)) {
+            // second chance
+            leaf->referenced.store(false, std::memory_order_relaxed);
+            cache->hand++;
+            continue;
+        }
+        // the last (newest) leaf takes the hole, the hand passes it, so it still waits for a whole round
+        clock[cache->hand] = clock.back();
+        clock.pop_back();
+        cache->hand++;
+        removeLeaf(leaf);
+        cache->evictions++;
+    }
+}
+
+void ART::removeLeaf(LeafNode *leaf) {
+    auto const &key = leaf->key;
+    // slots that hold the parent and the leaf
+    Node **parentSlot = nullptr;
+    Node **slot = &root;
+    Node *parent = nullptr;
+    uint8_t nodeByte = 0;
+    uint8_t depth = 0;
+    while (*slot != leaf) {
+        assert(*slot != nullptr && !(*slot)->isLeafNode);
+        parent = *slot;
+        parentSlot = slot;
+        depth = depth + parent->prefixLength;
+        nodeByte = key[depth];
+        slot = parent->findChild(nodeByte);
+        depth++;
+    }
+
+    if (fingerprints) {
+        fingerprints->erase(key, leaf);
+    }
+    memoryInUse -= leafSize();
+    if (parent == nullptr) {
+        replaceNode(nullptr, &root);
+        delete leaf;
+        return;
+    }
+    parent->removeChildren(nodeByte);
+    // no node is replaced if the parent stays, but suspended async lookups may still point to the leaf
+    structureVersion++;
+    delete leaf;
+
+    Node *replacement;
+    if (parent->numberOfChildren == 1) {
+        // a node with a single child does not branch anymore, the child takes its place. An inner child prepends the
+        // parent's prefix and the byte between them to its own prefix, it still fits because the key length is bound
+        auto [partOfKey, child] = childrenInKeyOrder(parent).front();
+        if (!child->isLeafNode) {
+            auto const length = static_cast<std::size_t>(parent->prefixLength + 1 + child->prefixLength);
+            assert(length <= child->prefix.size());
+            std::memmove(child->prefix.data() + parent->prefixLength + 1, child->prefix.data(), child->prefixLength);
+            std::memcpy(child->prefix.data(), parent->prefix.data(), parent->prefixLength);
+            child->prefix[parent->prefixLength] = partOfKey;
+            child->prefixLength = static_cast<uint8_t>(length);
+        }
+        replacement = child;
+    } else {
+        replacement = shrinkNode(parent);
+        if (replacement == parent) {
+            return;
+        }
+        memoryInUse += nodeSize(replacement);
+    }
+
+    replaceNode(replacement, parentSlot);
+    memoryInUse -= nodeSize(parent);
+    delete parent;
+}
+
+LeafNode *ART::lookupLeaf(const Key &key, Profiler::Sample *sample) {
+    Node *node = root;
+    uint8_t depth = 0;
+
+    while (true) {
+        if (node == nullptr) {
+            return nullptr;
+        }
+        if (sample != nullptr) [[unlikely]] {
+            sample->enter(node);
         }
 
         if (node->isLeafNode) {
-            // leaf matches
-            if (0 == std::memcmp(&dynamic_cast<LeafNode*>(node)->key, &key, depth)) {
-                return dynamic_cast<LeafNode *>(node)->getValue();
+            // prefixes are skipped optimistically on the way down, so the whole key has to match
+            if (dynamic_cast<LeafNode *>(node)->key == key) {
+                return dynamic_cast<LeafNode *>(node);
             } else {
-                return INVALID_VALUE;
+                return nullptr;
             }
         }
 
@@ -37,16 +464,274 @@ Value ART::lookup(const Key &key) {
         //    }
 
         depth = depth + node->prefixLength + 1;
+        if (depth > key.key_len) {
+            return nullptr;
+        }
         node = node->getChildren(key[depth - 1]);
+        if (node != nullptr && depth < key.key_len) {
+            prefetchChildSlot(node, key[depth]);
+        }
     }
 }
 
 bool ART::insert(const Key &key, Value value) {
-    auto *leaf = new LeafNode(key, value);
+    auto *sample = profiler ? profiler->begin(Profiler::Operation::Insert) : nullptr;
+    auto *leaf = insertIntoTree(key, value, sample);
+    if (sample != nullptr) {
+        profiler->end(sample);
+    }
+    if (leaf == nullptr) {
+        return false;
+    }
+    publishInsert(leaf);
+    if (cache) {
+        evictOverBudget();
+    }
+    if (checkpointDue) {
+        checkpoint();
+    }
+    return true;
+}
+
+void ART::publishInsert(LeafNode *leaf) {
+    if (cache) {
+        // no access bit yet: the hand reaches a new leaf only after a full round, a hit until then keeps it
+        cache->clock.push_back(static_cast<CachedLeafNode *>(leaf));
+    }
+    if (fingerprints) {
+        fingerprints->insert(leaf->key, leaf);
+    }
+    if (wal) {
+        // only copies the record, the flush thread makes it durable in the background
+        checkpointDue |= wal->appendInsert(leaf->key, leaf->value) && !cache;
+    }
+}
+
+/** number of leading bytes both keys share */
+static uint8_t commonPrefixLength(const Key &a, const Key &b) {
+    uint8_t i = 0;
+    auto const length = std::min(a.key_len, b.key_len);
+    while (i < length && a[i] == b[i]) {
+        i++;
+    }
+    return i;
+}
+
+/**
+ * Number of different bytes at `depth` among the keys of the sorted batch that start with entries[first] and share
+ * its first `depth` bytes, i.e. the children a node at that position will need (at most 256).
+ */
+static uint16_t upcomingChildren(std::span<const std::pair<Key, Value>> entries, std::size_t first, uint8_t depth,
+                                 Node *existing = nullptr) {
+    auto const &key = entries[first].first;
+    uint16_t count = 0;
+    int previousByte = -1;
+    for (auto j = first; j < entries.size() && count < 256; j++) {
+        auto const &other = entries[j].first;
+        if (other.key_len <= depth || commonPrefixLength(key, other) < depth) {
+            break;
+        }
+        if (other[depth] != previousByte) {
+            previousByte = other[depth];
+            // bytes that already have a child in `existing` do not need a new slot
+            if (existing == nullptr || existing->getChildren(other[depth]) == nullptr) {
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
+/** empty inner node that can hold `expectedChildren` without growing */
+static Node *createNode(uint16_t expectedChildren) {
+    if (expectedChildren <= 4) {
+        return new Node4();
+    }
+    if (expectedChildren <= 16) {
+        return new Node16();
+    }
+    if (expectedChildren <= 48) {
+        return new Node48();
+    }
+    return new Node256();
+}
+
+static uint16_t capacity(const Node *node) {
+    switch (node->type) {
+        case NodeType::N4:
+            return 4;
+        case NodeType::N16:
+            return 16;
+        case NodeType::N48:
+            return 48;
+        default:
+            return 256;
+    }
+}
+
+std::size_t ART::insert_batch(std::span<const std::pair<Key, Value>> entries) {
+    if (entries.empty()) {
+        return 0;
+    }
+
+    // one allocation for all leaves of the batch, released together with the tree. A cache evicts single leaves and
+    // the garbage collector frees single versions, so there every leaf gets its own allocation.
+    bool const singleLeaves = cache || versioned;
+    LeafNode *leaves = nullptr;
+    if (!singleLeaves) {
+        leaves = static_cast<LeafNode *>(NodeAllocator::allocate(entries.size() * sizeof(LeafNode)));
+        leafBlocks.emplace_back(leaves, entries.size());
+        memoryInUse += entries.size() * sizeof(LeafNode);
+    }
+
+    // inner nodes on the path of the previous key, outermost first
+    std::vector<BatchPathEntry> path;
+    path.reserve(std::tuple_size_v<decltype(Key::key)> + 1);
+    std::size_t inserted = 0;
+
+    for (std::size_t i = 0; i < entries.size(); i++) {
+        auto const &[key, value] = entries[i];
+        assert(i == 0 || compareKeys(entries[i - 1].first, key) <= 0);
+
+        // a node on the path is reached by the bytes before its depth only -> keep the nodes the keys agree on
+        if (i > 0) {
+            auto const common = commonPrefixLength(entries[i - 1].first, key);
+            while (!path.empty() && path.back().depth > common) {
+                path.pop_back();
+            }
+        }
+
+        NodePlacementScope placement{key.key_len > 0 ? key[0] : uint8_t{0}};
+        auto *leaf = singleLeaves ? createLeaf(key, value) : ::new(leaves + i) LeafNode(key, value);
+        if (insertBatchEntry(leaf, entries, i, path)) {
+            publishInsert(leaf);
+            inserted++;
+        } else if (singleLeaves) {
+            delete leaf;
+        }
+    }
+    if (singleLeaves) {
+        memoryInUse += inserted * leafSize();
+    }
+    if (cache) {
+        // evicting changes nodes on the path, so only after the whole batch
+        evictOverBudget();
+    }
+    if (checkpointDue) {
+        checkpoint();
+    }
+    return inserted;
+}
+
+bool ART::insertBatchEntry(LeafNode *leaf, std::span<const std::pair<Key, Value>> entries, std::size_t index,
+                           std::vector<BatchPathEntry> &path) {
+    auto const &key = leaf->key;
+    Node *parentNode = nullptr;
+    Node *node = root;
+    uint8_t depth = 0;
+    if (!path.empty()) {
+        parentNode = path.back().parent;
+        node = path.back().node;
+        depth = path.back().depth;
+        path.pop_back();
+    }
+
+    // slots are not kept on the path, they would dangle once their node grows
+    auto replaceWith = [&](Node *newNode) {
+        replaceNode(newNode, parentNode != nullptr ? parentNode->findChild(key[depth - 1]) : &root);
+    };
+
+    while (true) {
+        if (node == nullptr) {
+            root = leaf;
+            return true;
+        }
+
+        if (node->isLeafNode) {
+            auto const &key2 = dynamic_cast<LeafNode *>(node)->key;
+            auto const diverge = commonPrefixLength(key, key2);
+            if (versioned && diverge == key.key_len && diverge == key2.key_len) {
+                addVersion(static_cast<VersionedLeafNode *>(leaf), static_cast<VersionedLeafNode *>(node),
+                           parentNode != nullptr ? parentNode->findChild(key[depth - 1]) : &root);
+                return true;
+            }
+            if (diverge == key.key_len || diverge == key2.key_len) {
+                return false;
+            }
+            // the existing leaf plus all keys of the batch that end up below the new node
+            auto *newNode = createNode(1 + upcomingChildren(entries, index, diverge));
+            newNode->prefixLength = diverge - depth;
+            std::memcpy(newNode->prefix.data(), key.key.data() + depth, newNode->prefixLength);
+            newNode->addChildren(key2[diverge], node);
+            newNode->addChildren(key[diverge], leaf);
+            replaceWith(newNode);
+            memoryInUse += nodeSize(newNode);
+            path.push_back({newNode, parentNode, depth});
+            return true;
+        }
+
+        if (uint8_t p = node->checkPrefix(key, depth); p != node->prefixLength) {
+            if (depth + p >= key.key_len) {
+                return false;
+            }
+            auto *newNode = createNode(1 + upcomingChildren(entries, index, depth + p));
+            newNode->prefixLength = p;
+            std::memcpy(&newNode->prefix, &node->prefix, p);
+            newNode->addChildren(node->prefix[p], node);
+            newNode->addChildren(key[depth + p], leaf);
+            node->prefixLength = node->prefixLength - (p + 1);
+            std::memmove(begin(node->prefix), begin(node->prefix) + (p + 1), node->prefixLength);
+            replaceWith(newNode);
+            memoryInUse += nodeSize(newNode);
+            path.push_back({newNode, parentNode, depth});
+            return true;
+        }
+
+        path.push_back({node, parentNode, depth});
+        auto const branchDepth = static_cast<uint8_t>(depth + node->prefixLength);
+        if (branchDepth >= key.key_len) {
+            return false;
+        }
+        auto *next = node->getChildren(key[branchDepth]);
+        if (next != nullptr) {
+            parentNode = node;
+            node = next;
+            depth = branchDepth + 1;
+            continue;
+        }
+
+        if (node->isFull()) {
+            // grow once to the size the rest of the batch needs instead of one step at a time
+            auto const needed = node->numberOfChildren + upcomingChildren(entries, index, branchDepth, node);
+            Node *grown = node;
+            while (capacity(grown) < needed && grown->type != NodeType::N256) {
+                auto *bigger = growNode(grown);
+                if (grown != node) {
+                    delete grown;
+                }
+                grown = bigger;
+            }
+            replaceWith(grown);
+            memoryInUse += nodeSize(grown) - nodeSize(node);
+            delete node;
+            node = grown;
+            path.back().node = grown;
+        }
+        node->addChildren(key[branchDepth], leaf);
+        return true;
+    }
+}
+
+LeafNode *ART::insertIntoTree(const Key &key, Value value, Profiler::Sample *sample) {
+    // only has an effect for NumaPolicy::SubtreeBind
+    NodePlacementScope placement{key.key_len > 0 ? key[0] : uint8_t{0}};
+    auto *leaf = createLeaf(key, value);
+    auto const leafBytes = leafSize();
     // we need to store the last key information -> this is identifier for this particular node
     // we still save the whole key in the node, so we can reinterpret the path
 
-    Node *parentNode = nullptr;
+    // the slot that holds `node`, the root or a child slot of its parent
+    Node **slot = &root;
     Node *node = root;
     uint8_t depth = 0;
 
@@ -54,27 +739,52 @@ bool ART::insert(const Key &key, Value value) {
         if (node == nullptr) { // handle empty tree case
             // set as new root
             root = leaf;
-            return true;
+            memoryInUse += leafBytes;
+            return leaf;
+        }
+        if (sample != nullptr) [[unlikely]] {
+            sample->enter(node);
         }
 
         if (node->isLeafNode) {
-            auto newNode = new Node4();
             auto const &key2 = dynamic_cast<LeafNode*>(node)->key;
 
+            // lazy expansion: the existing leaf stood for its whole remaining key, only now we need an inner node,
+            // exactly at the byte where both keys diverge. The common bytes before it become its prefix.
             uint8_t i = depth;
-            for (; key[i] == key2[i]; i = i + 1) {
-                newNode->prefix[i - depth] = key[i];
+            while (i < key.key_len && i < key2.key_len && key[i] == key2[i]) {
+                i++;
             }
+            if (versioned && i == key.key_len && i == key2.key_len) {
+                addVersion(static_cast<VersionedLeafNode *>(leaf), static_cast<VersionedLeafNode *>(node), slot);
+                memoryInUse += leafBytes;
+                return leaf;
+            }
+            if (i == key.key_len || i == key2.key_len) {
+                // same key or one key is a prefix of the other -> there is no byte to branch on
+                delete leaf;
+                return nullptr;
+            }
+
+            auto newNode = new Node4();
             newNode->prefixLength = i - depth;
+            std::memcpy(newNode->prefix.data(), key.key.data() + depth, newNode->prefixLength);
 
             depth = depth + newNode->prefixLength;
             newNode->addChildren(key[depth], leaf);
             newNode->addChildren(key2[depth], node);
 
-            replaceNode(newNode, parentNode);
-            return true;
+            replaceNode(newNode, slot);
+            memoryInUse += leafBytes + sizeof(Node4);
+            return leaf;
         }
         if (uint8_t p = node->checkPrefix(key, depth); p != node->prefixLength) {
+            if (depth + p >= key.key_len) {
+                // key ends inside the prefix
+                delete leaf;
+                return nullptr;
+            }
+            // split the compressed path where the key leaves it, the old node keeps the rest of its prefix
             auto newNode = new Node4();
             newNode->addChildren(key[depth + p], leaf);
             newNode->addChildren(node->prefix[p], node);
@@ -82,69 +792,209 @@ bool ART::insert(const Key &key, Value value) {
             std::memcpy(&newNode->prefix, &node->prefix, p);
             node->prefixLength = node->prefixLength - (p + 1);
             std::memmove(begin(node->prefix), begin(node->prefix) + (p + 1), node->prefixLength);
-            replaceNode(newNode, parentNode);
-            return true;
+            replaceNode(newNode, slot);
+            memoryInUse += leafBytes + sizeof(Node4);
+            return leaf;
         }
         depth = depth + node->prefixLength;
-        auto *next = node->getChildren(key[depth]);
-        if (next != nullptr) {
-            parentNode = node;
-            node = next;
+        if (depth >= key.key_len) {
+            // key ends at an inner node
+            delete leaf;
+            return nullptr;
+        }
+        if (auto **next = node->findChild(key[depth])) {
+            slot = next;
+            node = *next;
             depth++;
         } else {
             if (node->isFull()) {
-                growAndReplaceNode(parentNode, node);
+                growAndReplaceNode(slot, node);
             }
             node->addChildren(key[depth], leaf);
-            return true;
+            memoryInUse += leafBytes;
+            return leaf;
         }
     }
 }
 
-void ART::replaceNode(Node *newNode, Node *parentNode) {
-    if (parentNode == nullptr) { // we need to set it as root
-        root = newNode;
+bool ART::recover(const std::string &directory, WalConfig config) {
+    if (root != nullptr || wal) {
+        return false;
+    }
+
+    auto replay = [this](const Key &key, Value value) {
+        auto *leaf = insertIntoTree(key, value);
+        if (leaf != nullptr && cache) {
+            cache->clock.push_back(static_cast<CachedLeafNode *>(leaf));
+            evictOverBudget();
+        }
+    };
+    auto const firstSegment = WriteAheadLog::readCheckpoint(directory, replay);
+    auto nextSegment = firstSegment;
+    for (auto segment: WriteAheadLog::listSegments(directory)) {
+        nextSegment = std::max(nextSegment, segment + 1);
+        if (segment < firstSegment) {
+            continue;
+        }
+        if (!WriteAheadLog::replaySegment(directory, segment, replay)) {
+            // torn tail -> everything after it was never acknowledged as durable
+            break;
+        }
+    }
+
+    wal = std::make_unique<WriteAheadLog>(directory, nextSegment, config);
+    // start from a clean checkpoint, so a torn tail is never replayed before newer segments
+    checkpoint();
+    return true;
+}
+
+void ART::checkpoint() {
+    if (!wal) {
         return;
     }
+    checkpointDue = false;
+    auto const segment = wal->rotate();
+    WriteAheadLog::writeCheckpoint(wal->getDirectory(), segment, [this](const EntryVisitor &visitor) {
+        forEachEntry(visitor);
+    });
+    wal->removeSegmentsBefore(segment);
+}
 
-    if (parentNode->type == NodeType::N4) {
-        dynamic_cast<Node4 *>(parentNode)->children[Node::indexOfChildLastAccessed] = newNode;
-    } else if (parentNode->type == NodeType::N16) {
-        dynamic_cast<Node16 *>(parentNode)->children[Node::indexOfChildLastAccessed] = newNode;
-    } else if (parentNode->type == NodeType::N48) {
-        dynamic_cast<Node48 *>(parentNode)->children[Node::indexOfChildLastAccessed] = newNode;
-    } else if (parentNode->type == NodeType::N256) {
-        dynamic_cast<Node256 *>(parentNode)->children[Node::indexOfChildLastAccessed] = newNode;
+void ART::sync() {
+    if (wal) {
+        wal->sync();
     }
 }
 
-void ART::growAndReplaceNode(Node *parentNode, Node *&node) {
+static void visitLeaves(const Node *node, const EntryVisitor &visitor) {
+    if (node == nullptr) {
+        return;
+    }
+    if (node->isLeafNode) {
+        auto leaf = dynamic_cast<const LeafNode *>(node);
+        visitor(leaf->key, leaf->value);
+        return;
+    }
+
     if (node->type == NodeType::N4) {
-        auto node4 = dynamic_cast<Node4 *>(node);
-        auto node16 = node4->grow();
-        node = node16;
+        auto node4 = dynamic_cast<const Node4 *>(node);
+        for (uint16_t i = 0; i < node4->numberOfChildren; i++) {
+            visitLeaves(node4->children[i], visitor);
+        }
     } else if (node->type == NodeType::N16) {
-        auto node16 = dynamic_cast<Node16 *>(node);
-        auto node48 = node16->grow();
-        node = node48;
+        auto node16 = dynamic_cast<const Node16 *>(node);
+        for (uint16_t i = 0; i < node16->numberOfChildren; i++) {
+            visitLeaves(node16->children[i], visitor);
+        }
     } else if (node->type == NodeType::N48) {
-        auto node48 = dynamic_cast<Node48 *>(node);
-        auto node256 = node48->grow();
-        node = node256;
+        auto node48 = dynamic_cast<const Node48 *>(node);
+        for (uint16_t i = 0; i < node48->numberOfChildren; i++) {
+            visitLeaves(node48->children[i], visitor);
+        }
+    } else if (node->type == NodeType::N256) {
+        for (auto child: dynamic_cast<const Node256 *>(node)->children) {
+            visitLeaves(child, visitor);
+        }
     }
+}
 
-    replaceNode(node, parentNode);
+void ART::forEachEntry(const EntryVisitor &visitor) const {
+    visitLeaves(root, visitor);
 }
 
-// NODE 4
-Node *Node4::getChildren(uint8_t const &partOfKey) {
-    for (uint8_t i = 0; i < this->keys.size(); i++) {
-        if (this->keys[i] == partOfKey) {
-            Node::indexOfChildLastAccessed = i;
-            return this->children[i];
+FrozenART ART::freeze() const {
+    return FrozenART{root};
+}
+
+std::vector<std::pair<uint8_t, Node *>> ART::childrenInKeyOrder(const Node *node) {
+    std::vector<std::pair<uint8_t, Node *>> children;
+    children.reserve(node->numberOfChildren);
+
+    if (node->type == NodeType::N4) {
+        auto node4 = dynamic_cast<const Node4 *>(node);
+        for (uint16_t i = 0; i < node4->numberOfChildren; i++) {
+            children.emplace_back(node4->keys[i], node4->children[i]);
+        }
+        // node4 and node16 keep their keys in insertion order
+        std::ranges::sort(children, {}, &std::pair<uint8_t, Node *>::first);
+    } else if (node->type == NodeType::N16) {
+        auto node16 = dynamic_cast<const Node16 *>(node);
+        for (uint16_t i = 0; i < node16->numberOfChildren; i++) {
+            children.emplace_back(node16->keys[i], node16->children[i]);
+        }
+        std::ranges::sort(children, {}, &std::pair<uint8_t, Node *>::first);
+    } else if (node->type == NodeType::N48) {
+        auto node48 = dynamic_cast<const Node48 *>(node);
+        for (uint16_t partOfKey = 0; partOfKey < 256; partOfKey++) {
+            if (auto index = node48->keys[partOfKey]; index != UNUSED_OFFSET_VALUE) {
+                children.emplace_back(partOfKey, node48->children[index]);
+            }
+        }
+    } else if (node->type == NodeType::N256) {
+        auto node256 = dynamic_cast<const Node256 *>(node);
+        for (uint16_t partOfKey = 0; partOfKey < 256; partOfKey++) {
+            if (auto *child = node256->children[partOfKey]) {
+                children.emplace_back(partOfKey, child);
+            }
         }
     }
-    return nullptr;
+    return children;
+}
+
+void ART::replaceNode(Node *newNode, Node **slot) {
+    structureVersion++;
+    *slot = newNode;
+}
+
+Node *ART::growNode(Node *node) {
+    if (node->type == NodeType::N4) {
+        return dynamic_cast<Node4 *>(node)->grow();
+    } else if (node->type == NodeType::N16) {
+        return dynamic_cast<Node16 *>(node)->grow();
+    } else if (node->type == NodeType::N48) {
+        return dynamic_cast<Node48 *>(node)->grow();
+    }
+    return node;
+}
+
+Node *ART::shrinkNode(Node *node) {
+    // shrink a little later than the smaller node would be full, so a node at the border does not flip on every change
+    if (node->type == NodeType::N16 && node->numberOfChildren <= 3) {
+        return dynamic_cast<Node16 *>(node)->shrink();
+    } else if (node->type == NodeType::N48 && node->numberOfChildren <= 12) {
+        return dynamic_cast<Node48 *>(node)->shrink();
+    } else if (node->type == NodeType::N256 && node->numberOfChildren <= 37) {
+        return dynamic_cast<Node256 *>(node)->shrink();
+    }
+    return node;
+}
+
+std::size_t ART::nodeSize(const Node *node) {
+    assert(!node->isLeafNode);
+    switch (node->type) {
+        case NodeType::N4:
+            return sizeof(Node4);
+        case NodeType::N16:
+            return sizeof(Node16);
+        case NodeType::N48:
+            return sizeof(Node48);
+        default:
+            return sizeof(Node256);
+    }
+}
+
+void ART::growAndReplaceNode(Node **slot, Node *&node) {
+    auto *grown = growNode(node);
+    replaceNode(grown, slot);
+    memoryInUse += nodeSize(grown) - nodeSize(node);
+    delete node;
+    node = grown;
+}
+
+// NODE 4
+Node **Node4::findChild(uint8_t const &partOfKey) {
+    auto const index = findKeyByte4(this->keys.data(), partOfKey, numberOfChildren);
+    return index >= 0 ? &this->children[index] : nullptr;
 }
 
 void Node4::addChildren(uint8_t const &partOfKey, Node *child) {
@@ -153,6 +1003,19 @@ void Node4::addChildren(uint8_t const &partOfKey, Node *child) {
     this->numberOfChildren++;
 }
 
+void Node4::removeChildren(uint8_t const &partOfKey) {
+    // keys are unordered, the last child fills the hole
+    for (uint8_t i = 0; i < numberOfChildren; i++) {
+        if (this->keys[i] == partOfKey) {
+            numberOfChildren--;
+            this->keys[i] = this->keys[numberOfChildren];
+            this->children[i] = this->children[numberOfChildren];
+            this->children[numberOfChildren] = nullptr;
+            return;
+        }
+    }
+}
+
 bool Node4::isFull() {
     return this->numberOfChildren == 4;
 }
@@ -163,7 +1026,8 @@ Node16 *Node4::grow() {
     node16->numberOfChildren = this->numberOfChildren;
     node16->prefix = this->prefix;
     node16->prefixLength = this->prefixLength;
-    for (int i = 0; i < 4; i++) {
+    // insert_batch also grows nodes that are not full
+    for (uint16_t i = 0; i < this->numberOfChildren; i++) {
         node16->keys[i] = this->keys[i];
         node16->children[i] = this->children[i];
     }
@@ -172,20 +1036,15 @@ Node16 *Node4::grow() {
 }
 
 // NODE 16
-Node *Node16::getChildren(uint8_t const &partOfKey) {
-    auto keyToSearchRegister = _mm_set1_epi8(partOfKey);
-    auto keysInNodeRegister = _mm_set_epi8(
-            keys[15], keys[14], keys[13], keys[12],
-            keys[11], keys[10], keys[9], keys[8],
-            keys[7], keys[6], keys[5], keys[4],
-            keys[3], keys[2], keys[1], keys[0]
-    );
+Node **Node16::findChild(uint8_t const &partOfKey) {
+    auto keyToSearchRegister = _mm_set1_epi8(static_cast<char>(partOfKey));
+    // one unaligned load instead of assembling the register byte by byte
+    auto keysInNodeRegister = _mm_loadu_si128(reinterpret_cast<const __m128i *>(this->keys.data()));
     auto cmp = _mm_cmpeq_epi8(keyToSearchRegister, keysInNodeRegister);
     auto mask = (1 << numberOfChildren) - 1;
 
     if (auto bitfield = _mm_movemask_epi8(cmp) & mask) {
-        Node::indexOfChildLastAccessed = __builtin_ctz(bitfield);
-        return this->children[Node::indexOfChildLastAccessed];
+        return &this->children[__builtin_ctz(bitfield)];
     }
 
     return nullptr;
@@ -197,6 +1056,18 @@ void Node16::addChildren(uint8_t const &partOfKey, Node *child) {
     this->numberOfChildren++;
 }
 
+void Node16::removeChildren(uint8_t const &partOfKey) {
+    for (uint8_t i = 0; i < numberOfChildren; i++) {
+        if (this->keys[i] == partOfKey) {
+            numberOfChildren--;
+            this->keys[i] = this->keys[numberOfChildren];
+            this->children[i] = this->children[numberOfChildren];
+            this->children[numberOfChildren] = nullptr;
+            return;
+        }
+    }
+}
+
 bool Node16::isFull() {
     return this->numberOfChildren == 16;
 }
@@ -207,7 +1078,9 @@ Node48 *Node16::grow() {
     node48->numberOfChildren = this->numberOfChildren;
     node48->prefix = this->prefix;
     node48->prefixLength = this->prefixLength;
-    for (uint8_t i = 0; i < 16; i++) {
+    // only the used slots: insert_batch also grows nodes that are not full, and the key byte of an unused slot would
+    // overwrite the offset of a real child
+    for (uint8_t i = 0; i < this->numberOfChildren; i++) {
         // we have to use offsets in node48
         // save index as value at position key
         node48->keys[this->keys[i]] = i;
@@ -218,16 +1091,24 @@ Node48 *Node16::grow() {
     return node48;
 }
 
+Node4 *Node16::shrink() {
+    auto *node4 = new Node4();
+
+    node4->prefix = this->prefix;
+    node4->prefixLength = this->prefixLength;
+    for (uint8_t i = 0; i < this->numberOfChildren; i++) {
+        node4->addChildren(this->keys[i], this->children[i]);
+    }
+
+    return node4;
+}
+
 // NODE 48
-Node *Node48::getChildren(uint8_t const &partOfKey) {
+Node **Node48::findChild(uint8_t const &partOfKey) {
     auto index = this->keys[partOfKey];
     // index can only be between 0 and 47 -> so if different value -> it is an error
-    // might also be suitable to fill they keys before up and then just check for the ERROR_VALUE instead of this random "48"
-    if (index != UNUSED_OFFSET_VALUE) {
-        Node::indexOfChildLastAccessed = index;
-        return this->children[index];
-    }
-    return nullptr;
+    // getChildren loads children[index] right after, so a lookup still does two dependent loads in a node48
+    return index != UNUSED_OFFSET_VALUE ? &this->children[index] : nullptr;
 }
 
 void Node48::addChildren(uint8_t const &partOfKey, Node *child) {
@@ -236,6 +1117,26 @@ void Node48::addChildren(uint8_t const &partOfKey, Node *child) {
     this->numberOfChildren++;
 }
 
+void Node48::removeChildren(uint8_t const &partOfKey) {
+    auto index = this->keys[partOfKey];
+    if (index == UNUSED_OFFSET_VALUE) {
+        return;
+    }
+    this->keys[partOfKey] = UNUSED_OFFSET_VALUE;
+    numberOfChildren--;
+    // addChildren appends at numberOfChildren, so the last child moves into the hole
+    if (index != numberOfChildren) {
+        this->children[index] = this->children[numberOfChildren];
+        for (auto &offset: this->keys) {
+            if (offset == numberOfChildren) {
+                offset = index;
+                break;
+            }
+        }
+    }
+    this->children[numberOfChildren] = nullptr;
+}
+
 bool Node48::isFull() {
     return this->numberOfChildren == 48;
 }
@@ -258,10 +1159,23 @@ Node256 *Node48::grow() {
     return node256;
 }
 
+Node16 *Node48::shrink() {
+    auto *node16 = new Node16();
+
+    node16->prefix = this->prefix;
+    node16->prefixLength = this->prefixLength;
+    for (uint16_t i = 0; i < 256; i++) {
+        if (auto index = this->keys[i]; index != UNUSED_OFFSET_VALUE) {
+            node16->addChildren(i, this->children[index]);
+        }
+    }
+
+    return node16;
+}
+
 // NODE 256
-Node *Node256::getChildren(uint8_t const &partOfKey) {
-    Node::indexOfChildLastAccessed = partOfKey;
-    return this->children[partOfKey];
+Node **Node256::findChild(uint8_t const &partOfKey) {
+    return this->children[partOfKey] != nullptr ? &this->children[partOfKey] : nullptr;
 }
 
 void Node256::addChildren(uint8_t const &partOfKey, Node *child) {
@@ -269,6 +1183,27 @@ void Node256::addChildren(uint8_t const &partOfKey, Node *child) {
     this->numberOfChildren++;
 }
 
+void Node256::removeChildren(uint8_t const &partOfKey) {
+    if (this->children[partOfKey] != nullptr) {
+        this->children[partOfKey] = nullptr;
+        this->numberOfChildren--;
+    }
+}
+
 bool Node256::isFull() {
     return numberOfChildren == 256;
 }
+
+Node48 *Node256::shrink() {
+    auto *node48 = new Node48();
+
+    node48->prefix = this->prefix;
+    node48->prefixLength = this->prefixLength;
+    for (uint16_t i = 0; i < 256; i++) {
+        if (this->children[i] != nullptr) {
+            node48->addChildren(i, this->children[i]);
+        }
+    }
+
+    return node48;
+}
@@ -1,6 +1,25 @@
 #pragma once
 
 #include "key.hpp"
+#include "key_utils.hpp"
+#include "async_lookup.hpp"
+#include "fingerprint_table.hpp"
+#include "frozen_art.hpp"
+#include "node_allocator.hpp"
+#include "profiler.hpp"
+#include "wal.hpp"
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <span>
+#include <utility>
+#include <vector>
+
+/** commit timestamp of a leaf version, see ART::snapshot */
+using Timestamp = uint64_t;
 
 /** These are the four node sizes as described in the paper. Do not change these values! */
 enum class NodeType : uint8_t {
@@ -21,18 +40,24 @@ public:
 
     uint16_t numberOfChildren = 0;
 
-    static uint8_t indexOfChildLastAccessed;
-
+    // compressed path of this node. Keys have at most 8 bytes and a node consumes at least one byte, so the prefix
+    // can never be longer than 7 bytes and we always store it completely (pessimistic path compression).
     std::array<uint8_t, 8> prefix{};
 
-    uint8_t prefixLength;
+    uint8_t prefixLength = 0;
 
     explicit Node(NodeType type, bool isLeaf) : type{type}, isLeafNode(isLeaf) {}
 
+    // all nodes and leaves go through the node allocator, so they can live in the huge page arena
+    static void *operator new(std::size_t size) { return NodeAllocator::allocate(size); }
+
+    static void operator delete(void *ptr, std::size_t size) { NodeAllocator::deallocate(ptr, size); }
+
+    /** number of prefix bytes that match the key from `depth` on, stops at the end of the key */
     uint8_t checkPrefix(const Key &key, uint8_t const &depth) {
         int idx = 0;
         for (; idx < this->prefixLength; idx++) {
-            if (this->prefix[idx] != key[depth + idx])
+            if (depth + idx >= key.key_len || this->prefix[idx] != key[depth + idx])
                 return idx;
         }
         return idx;
@@ -40,13 +65,27 @@ public:
 
     virtual ~Node() = default;
 
-    virtual Node *getChildren(uint8_t const &partOfKey) = 0;
+    /**
+     * slot that holds the child for `partOfKey`, nullptr if there is none. Writing the slot replaces the child, so
+     * callers that modify the tree do not need to find it again.
+     */
+    virtual Node **findChild(uint8_t const &partOfKey) = 0;
+
+    Node *getChildren(uint8_t const &partOfKey) {
+        auto **slot = findChild(partOfKey);
+        return slot != nullptr ? *slot : nullptr;
+    }
 
     virtual void addChildren(uint8_t const &partOfKey, Node *child) = 0;
 
+    virtual void removeChildren(uint8_t const &partOfKey) = 0;
+
     virtual bool isFull() = 0;
 };
 
+static_assert(std::tuple_size_v<decltype(Key::key)> - 1 <= std::tuple_size_v<decltype(Node::prefix)>,
+              "the prefix array has to hold the longest possible compressed path");
+
 class LeafNode : public Node {
 public:
     Key key;
@@ -61,25 +100,71 @@ public:
     }
 
     // we don't need those
-    [[gnu::unused]] Node *getChildren(uint8_t const &partOfKey) override { return nullptr; }
+    [[gnu::unused]] Node **findChild(uint8_t const &partOfKey) override { return nullptr; }
 
     [[gnu::unused]] void addChildren(uint8_t const &partOfKey, Node *child) override {
         // noop
     };
 
+    [[gnu::unused]] void removeChildren(uint8_t const &partOfKey) override {
+        // noop
+    };
+
     [[gnu::unused]] bool isFull() override { return true; };
 };
 
+// the extra state of the cache and versioning modes lives in subclasses, plain trees do not pay for it
+static_assert(sizeof(LeafNode) <= 48, "a plain leaf should stay within 48 bytes");
+
+/** Leaf of a tree in cache mode (see ART::enableCacheMode). */
+class CachedLeafNode : public LeafNode {
+public:
+    using LeafNode::LeafNode;
+
+    // access bit, set by lookup hits and cleared by the clock hand
+    std::atomic<bool> referenced{false};
+};
+
+/** One version of a key in a tree with ART::enableVersioning. */
+class VersionedLeafNode : public LeafNode {
+public:
+    VersionedLeafNode(Key key, Value value, Timestamp beginTimestamp)
+            : LeafNode(key, value), beginTimestamp(beginTimestamp) {}
+
+    // insert that created this version, and the version it replaced
+    Timestamp beginTimestamp;
+    VersionedLeafNode *olderVersion = nullptr;
+
+    /** the newest version in this chain that is visible at `readTimestamp`, nullptr if there is none */
+    const VersionedLeafNode *visibleAt(Timestamp readTimestamp) const {
+        auto const *version = this;
+        while (version != nullptr && version->beginTimestamp > readTimestamp) {
+            version = version->olderVersion;
+        }
+        return version;
+    }
+};
+
+class Node4;
+
+class Node16;
+
+class Node48;
+
 class Node256 : public Node {
 public:
     explicit Node256() : Node(NodeType::N256, false) {}
 
-    Node *getChildren(uint8_t const &partOfKey) override;
+    Node **findChild(uint8_t const &partOfKey) override;
 
     void addChildren(uint8_t const &partOfKey, Node *child) override;
 
+    void removeChildren(uint8_t const &partOfKey) override;
+
     bool isFull() override;
 
+    Node48 *shrink();
+
     // don't need keys -> because can directly map
     std::array<Node *, 256> children{};
 };
@@ -92,12 +177,16 @@ public:
         std::ranges::fill(keys.begin(), keys.end(), UNUSED_OFFSET_VALUE);
     }
 
-    Node *getChildren(uint8_t const &partOfKey) override;
+    Node **findChild(uint8_t const &partOfKey) override;
 
     void addChildren(uint8_t const &partOfKey, Node *child) override;
 
+    void removeChildren(uint8_t const &partOfKey) override;
+
     bool isFull() override;
 
+    Node16 *shrink();
+
     Node256 *grow();
 
     // we do it by storing the offset in the keys
@@ -109,12 +198,16 @@ class Node16 : public Node {
 public:
     explicit Node16() : Node(NodeType::N16, false) {}
 
-    Node *getChildren(uint8_t const &partOfKey) override;
+    Node **findChild(uint8_t const &partOfKey) override;
 
     void addChildren(uint8_t const &partOfKey, Node *child) override;
 
+    void removeChildren(uint8_t const &partOfKey) override;
+
     bool isFull() override;
 
+    Node4 *shrink();
+
     Node48 *grow();
 
     std::array<uint8_t, 16> keys{};
@@ -126,10 +219,12 @@ class Node4 : public Node {
 public:
     explicit Node4() : Node(NodeType::N4, false) {}
 
-    Node *getChildren(uint8_t const &partOfKey) override;
+    Node **findChild(uint8_t const &partOfKey) override;
 
     void addChildren(uint8_t const &partOfKey, Node *child) override;
 
+    void removeChildren(uint8_t const &partOfKey) override;
+
     bool isFull() override;
 
     Node16 *grow();
@@ -138,11 +233,193 @@ public:
     std::array<Node *, 4> children{};
 };
 
+class ART;
+
+/**
+ * Remembers the inner nodes of the last descent, so the next lookup with a similar key can start at the deepest node
+ * it shares with the previous key instead of at the root. A cursor must not be shared between threads, keep one per
+ * thread (e.g. thread_local) or per scan-like loop. It resets itself whenever the tree replaced any node.
+ */
+class LookupCursor {
+public:
+    /** inner levels that did not have to be visited again thanks to the cursor */
+    uint64_t levelsSkipped = 0;
+
+private:
+    friend class ART;
+
+    struct PathEntry {
+        Node *node;
+        // number of key bytes consumed before this node (its prefix not included)
+        uint8_t depth;
+    };
+
+    const ART *tree = nullptr;
+    uint64_t structureVersion = 0;
+    Key lastKey{};
+    // a key has 8 bytes and every inner node consumes one -> at most 8 inner nodes on a path
+    std::array<PathEntry, 8> path{};
+    uint8_t pathLength = 0;
+};
+
+/**
+ * A registered reader of an ART. Scans with a snapshot only see versions committed up to its timestamp, no matter how
+ * many inserts happen in between. The garbage collector keeps all versions that an active snapshot may still see, so
+ * release snapshots soon. Not copyable, the destructor unregisters it.
+ */
+class Snapshot {
+public:
+    Snapshot(Snapshot &&other) noexcept : tree(std::exchange(other.tree, nullptr)), timestamp(other.timestamp) {}
+
+    Snapshot(const Snapshot &) = delete;
+
+    Snapshot &operator=(const Snapshot &) = delete;
+
+    ~Snapshot();
+
+    Timestamp getTimestamp() const { return timestamp; }
+
+private:
+    friend class ART;
+
+    Snapshot(ART *tree, Timestamp timestamp) : tree(tree), timestamp(timestamp) {}
+
+    ART *tree;
+    Timestamp timestamp;
+};
+
+/** return false to stop a scan */
+using ScanVisitor = std::function<bool(const Key &, Value)>;
+
+/** Counters of the cache mode, see ART::enableCacheMode. */
+struct CacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    // bytes of all nodes and leaves of the tree and the budget they are kept below
+    std::size_t memoryUsage = 0;
+    std::size_t budgetBytes = 0;
+};
+
 /** This is the actual ART index that you need to implement. You will need to modify this class for this task. */
 class ART {
 private:
     Node *root = nullptr;
 
+    // incremented whenever a node is replaced or freed, invalidates the paths of all LookupCursors and suspended
+    // lookup_async calls
+    uint64_t structureVersion = 0;
+
+    // only set if durability is enabled through recover()
+    std::unique_ptr<WriteAheadLog> wal;
+
+    // the current log segment reached WalConfig::checkpointBytes, checkpoint once the insert is done
+    bool checkpointDue = false;
+
+    // only set if enabled through enableFingerprintTable()
+    std::unique_ptr<FingerprintTable> fingerprints;
+
+    // bytes of all nodes and leaves currently linked into the tree
+    std::size_t memoryInUse = 0;
+
+    struct Cache {
+        std::size_t budgetBytes;
+        // leaves in insertion order (more or less, evicting moves the newest leaf into the hole), swept by the hand
+        std::vector<CachedLeafNode *> clock;
+        std::size_t hand = 0;
+        // lookups may run concurrently. Every thread counts in its own stripe (threads share one only beyond
+        // STRIPES threads), so lookups on different cores never write to the same cache line.
+        struct alignas(64) CounterStripe {
+            std::atomic<uint64_t> hits{0};
+            std::atomic<uint64_t> misses{0};
+        };
+        static constexpr std::size_t STRIPES = 64;
+        std::array<CounterStripe, STRIPES> counters;
+        uint64_t evictions = 0;
+    };
+
+    // only set if enabled through enableCacheMode()
+    std::unique_ptr<Cache> cache;
+
+    // timestamp of the last insert, every leaf version gets the next one
+    std::atomic<Timestamp> lastCommitTimestamp{0};
+
+    // set through enableVersioning(): inserting an existing key adds a version instead of failing
+    bool versioned = false;
+
+    // keys that have older versions, the garbage collector only has to look at their chains
+    std::vector<Key> versionChains;
+
+    // timestamps of the active snapshots, readers register from any thread
+    mutable std::mutex snapshotMutex;
+    std::multiset<Timestamp> activeSnapshots;
+
+    friend class Snapshot;
+
+    // only set if enabled through enableProfiling() or the ART_PROFILE environment variable
+    std::unique_ptr<Profiler> profiler;
+
+    /** stripe of Cache::counters for the calling thread */
+    static std::size_t counterStripe();
+
+    /** sets the access bit of a hit (only if it is not set yet, so hot leaves are not written over and over) */
+    void recordAccess(LeafNode *leaf) {
+        auto &counters = cache->counters[counterStripe()];
+        if (leaf == nullptr) {
+            counters.misses.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        counters.hits.fetch_add(1, std::memory_order_relaxed);
+        auto &referenced = static_cast<CachedLeafNode *>(leaf)->referenced;
+        if (!referenced.load(std::memory_order_relaxed)) {
+            referenced.store(true, std::memory_order_relaxed);
+        }
+    }
+
+    /** new single leaf of the type this tree needs: cached, versioned (with the next commit timestamp) or plain */
+    LeafNode *createLeaf(const Key &key, Value value);
+
+    /** bytes of a single leaf of this tree */
+    std::size_t leafSize() const {
+        return cache ? sizeof(CachedLeafNode) : versioned ? sizeof(VersionedLeafNode) : sizeof(LeafNode);
+    }
+
+    /** runs the clock hand until the tree fits into the budget again */
+    void evictOverBudget();
+
+    /** unlinks `leaf` from the tree, shrinks or collapses its parent if needed and frees the leaf */
+    void removeLeaf(LeafNode *leaf);
+
+    /** inserts without logging or caching, returns the new leaf or nullptr */
+    LeafNode *insertIntoTree(const Key &key, Value value, Profiler::Sample *sample = nullptr);
+
+    /** maintains the side table and the log after a leaf was added */
+    void publishInsert(LeafNode *leaf);
+
+    struct BatchPathEntry {
+        Node *node;
+        Node *parent;
+        // number of key bytes consumed before this node (its prefix not included)
+        uint8_t depth;
+    };
+
+    // blocks of leaves allocated by insert_batch (first leaf, number of leaves)
+    std::vector<std::pair<LeafNode *, std::size_t>> leafBlocks;
+
+    /** inserts entries[index] (already constructed as `leaf`), resuming from the path of the previous key */
+    bool insertBatchEntry(LeafNode *leaf, std::span<const std::pair<Key, Value>> entries, std::size_t index,
+                          std::vector<BatchPathEntry> &path);
+
+    /** the actual tree walk of lookup, returns nullptr if the key was not found */
+    LeafNode *lookupLeaf(const Key &key, Profiler::Sample *sample = nullptr);
+
+    /** makes `leaf` the newest version of the same key in place of `current`, which is stored in `slot` */
+    void addVersion(VersionedLeafNode *leaf, VersionedLeafNode *current, Node **slot);
+
+    /** scan below `node`, `path` holds the key bytes that lead to it. Returns false once the scan is done. */
+    bool scanNode(const Node *node, std::array<uint8_t, 8> &path, uint8_t depth, const Key &from, const Key &to,
+                  Timestamp readTimestamp, const ScanVisitor &visitor) const;
+
 public:
     ART();
 
@@ -150,12 +427,20 @@ public:
 
     /**
      * insert - load `value` into the tree for `key`.
-     * Returns true if insert was successful, false otherwise.
+     * Returns true if insert was successful, false otherwise. Inserting an existing key or a key that is a prefix of
+     * another one (or the other way around) fails, there is no byte left to tell them apart.
      *
      * Read the task description for assumptions you can make when implementing this method.
      */
     bool insert(const Key &key, Value value);
 
+    /**
+     * insert_batch - insert entries sorted by key (memcmp order). Keeps the path of the previous key and only goes back
+     * up to the node both keys share, sizes new and growing nodes for the keys still to come and allocates all leaves
+     * in one block. Returns the number of inserted entries, entries that insert() would reject are skipped.
+     */
+    std::size_t insert_batch(std::span<const std::pair<Key, Value>> entries);
+
     /**
      * lookup - search for given key k in data using the index.
      * Returns INVALID_VALUE if the entry was not found.
@@ -164,12 +449,130 @@ public:
      */
     Value lookup(const Key &key);
 
+    /**
+     * lookup - same as above, but resumes the descent from the deepest node of the previous lookup with `cursor` that
+     * the new key still leads to. Pays off when consecutive keys share leading bytes, e.g. time-ordered ids.
+     */
+    Value lookup(const Key &key, LookupCursor &cursor);
+
+    /**
+     * lookup_async - same as lookup, but prefetches every node before visiting it and suspends in between, so lookups
+     * running on the same LookupScheduler hide each other's cache misses. The key is copied into the coroutine.
+     * Inserts (and the evictions and garbage collection they cause) may run while lookups are suspended, e.g. from the
+     * same thread between two runs of the scheduler. A lookup that notices this on resume starts over at the root,
+     * because the node it was about to visit may have been freed. Resume lookups only while holding the tree shared.
+     */
+    LookupTask lookup_async(Key key);
+
+    /**
+     * enableFingerprintTable - answer point lookups from a hash side table of at most `budgetBytes` first and only walk
+     * the tree on a miss. Entries are added on insert and on lookups that had to walk the tree, which is safe for
+     * lookups that share the tree (e.g. under a shared lock).
+     */
+    void enableFingerprintTable(std::size_t budgetBytes);
+
+    /**
+     * enableCacheMode - caps the tree at `budgetBytes` of nodes and leaves. Whenever an insert exceeds the budget, a
+     * CLOCK hand sweeps over the leaves: a leaf that was hit by a lookup since the last sweep only loses its access
+     * bit, the others are evicted and their nodes shrink (or collapse into their last child) as they get emptier.
+     * Must be enabled on an empty tree. Evicted keys are not logged, recover() brings them back.
+     * Returns false if this tree is not empty or already a cache.
+     */
+    bool enableCacheMode(std::size_t budgetBytes);
+
+    /**
+     * enableVersioning - keep older versions of a key: inserting an existing key succeeds and adds a new version that
+     * lookup() returns from then on, scans with an older snapshot still see the version before it.
+     * Must be enabled on an empty tree and does not work together with the cache mode.
+     * Returns false if this tree is not empty or a cache.
+     */
+    bool enableVersioning();
+
+    /**
+     * snapshot - registers a reader at the timestamp of the last insert. Taking a snapshot is thread safe, all other
+     * methods still need external synchronization: lookups and scans may share the tree (e.g. a shared lock), inserts
+     * and collectGarbage need it exclusively. A long scan does not have to hold the lock all the time, it can stop
+     * after some entries, release it and resume after the last key it saw with the same snapshot.
+     */
+    Snapshot snapshot();
+
+    /**
+     * scan - calls `visitor` in key order for every key with from <= key <= to, with the value of the newest version
+     * visible to `snapshot`. Stops when the visitor returns false. Only versioned trees (see enableVersioning) keep
+     * the commit timestamps, other trees are scanned as they are now.
+     */
+    void scan(const Key &from, const Key &to, const Snapshot &snapshot, const ScanVisitor &visitor) const;
+
+    /**
+     * collectGarbage - frees all versions that neither lookup() nor any active snapshot can see anymore, that is
+     * all versions that were replaced by a version not newer than the oldest active snapshot.
+     * Returns the number of freed versions.
+     */
+    std::size_t collectGarbage();
+
+    /**
+     * enableProfiling - sample every `sampleEvery`-th lookup and insert and attribute its time and hardware counter
+     * events to the levels and node types it visited, see Profiler. Sampled lookups skip the fingerprint table.
+     */
+    void enableProfiling(uint32_t sampleEvery);
+
+    /** getProfiler - the profiler for reports and folded stacks, nullptr if profiling is not enabled */
+    const Profiler *getProfiler() const { return profiler.get(); }
+
+    /** cacheStats - hit, miss and eviction counters of the cache mode (all zero if it is not enabled) */
+    CacheStats cacheStats() const;
+
+    /** memoryUsage - bytes of all nodes and leaves in the tree */
+    std::size_t memoryUsage() const { return memoryInUse; }
+
+    /**
+     * recover - rebuild the tree from the last checkpoint and the log tail in `directory` and log all further
+     * mutations there. Use it on an empty directory to enable durability for a new tree.
+     * Returns false if this tree is not empty or already durable.
+     */
+    bool recover(const std::string &directory, WalConfig config = {});
+
+    /**
+     * checkpoint - dump the whole tree to the checkpoint file and drop the log segments it covers.
+     * Does nothing if durability is not enabled. Inserts call it on their own once the log grew by
+     * WalConfig::checkpointBytes, except in cache mode: there the log is the only copy of the evicted keys.
+     */
+    void checkpoint();
+
+    /**
+     * sync - block until all mutations so far are durable. Inserts themselves do not wait for the log. Throws the
+     * std::system_error of the log if it could not be written, inserts throw it from then on as well.
+     */
+    void sync();
+
+    /**
+     * freeze - builds an immutable, compact copy of the tree for read-only use. The tree itself stays unchanged.
+     */
+    FrozenART freeze() const;
+
+    /** childrenInKeyOrder - all (key byte, child) pairs of an inner node, sorted by the key byte. */
+    static std::vector<std::pair<uint8_t, Node *>> childrenInKeyOrder(const Node *node);
+
+    /** forEachEntry - calls `visitor` for every key/value pair in the tree (in no particular order). */
+    void forEachEntry(const EntryVisitor &visitor) const;
+
     /**
      * get_root - returns root node for further inspection. No need mot modify this.
      */
     Node *get_root() { return root; };
 
-    void growAndReplaceNode(Node *parentNode, Node *&node);
+    /** grows `node` (stored in `slot`) and puts the bigger node there, `node` is updated and the old one freed */
+    void growAndReplaceNode(Node **slot, Node *&node);
+
+    /** grows node4/16/48 to the next size, returns node256 unchanged */
+    static Node *growNode(Node *node);
+
+    /** shrinks node16/48/256 to the next smaller size if they would fit well, returns the node unchanged otherwise */
+    static Node *shrinkNode(Node *node);
+
+    /** bytes of an inner node of this type, leaves depend on the mode of the tree (see leafSize) */
+    static std::size_t nodeSize(const Node *node);
 
-    void replaceNode(Node *newNode, Node *parentNode);
+    /** puts `newNode` into `slot` (a child slot of an inner node or &root) */
+    void replaceNode(Node *newNode, Node **slot);
 };
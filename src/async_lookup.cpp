@@ -0,0 +1,66 @@
+#include "async_lookup.hpp"
+
+#include "art.hpp"
+
+#include <algorithm>
+#include <vector>
+
+LookupScheduler &LookupScheduler::current() {
+    static thread_local LookupScheduler scheduler;
+    return scheduler;
+}
+
+void LookupScheduler::cancel(std::coroutine_handle<> handle) {
+    std::erase(ready, handle);
+}
+
+void LookupScheduler::run() {
+    while (!ready.empty()) {
+        auto handle = ready.front();
+        ready.pop_front();
+        handle.resume();
+    }
+}
+
+void LookupScheduler::lookupBatch(ART &tree, std::span<const Key> keys, std::span<Value> values,
+                                  std::size_t maxInFlight) {
+    assert(keys.size() == values.size());
+    auto &scheduler = current();
+    maxInFlight = std::max<std::size_t>(maxInFlight, 1);
+
+    // slot i holds the lookup for keys[indices[i]], a finished slot is refilled with the next key
+    std::vector<LookupTask> inFlight;
+    std::vector<std::size_t> indices;
+    inFlight.reserve(maxInFlight);
+    std::size_t next = 0;
+    for (; next < keys.size() && next < maxInFlight; next++) {
+        inFlight.push_back(tree.lookup_async(keys[next]));
+        indices.push_back(next);
+        scheduler.schedule(inFlight.back().coroutine());
+    }
+
+    while (!scheduler.empty()) {
+        // one round: every lookup advances by one level (or finishes)
+        auto const round = scheduler.ready.size();
+        for (std::size_t i = 0; i < round; i++) {
+            auto handle = scheduler.ready.front();
+            scheduler.ready.pop_front();
+            handle.resume();
+        }
+
+        for (std::size_t slot = 0; slot < inFlight.size(); slot++) {
+            if (!inFlight[slot].done() || indices[slot] == keys.size()) {
+                continue;
+            }
+            values[indices[slot]] = inFlight[slot].result();
+            if (next < keys.size()) {
+                inFlight[slot] = tree.lookup_async(keys[next]);
+                indices[slot] = next++;
+                scheduler.schedule(inFlight[slot].coroutine());
+            } else {
+                // mark the slot as collected
+                indices[slot] = keys.size();
+            }
+        }
+    }
+}
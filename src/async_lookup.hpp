@@ -0,0 +1,135 @@
+#pragma once
+
+#include "key.hpp"
+
+#include <coroutine>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <span>
+#include <utility>
+
+class ART;
+
+/**
+ * Round robin scheduler for suspended lookups. There is one per thread: every lookup that suspends to wait for a
+ * prefetch puts itself at the back of the queue, so while one lookup waits for DRAM, the others make progress.
+ */
+class LookupScheduler {
+public:
+    /** the scheduler of the calling thread */
+    static LookupScheduler &current();
+
+    void schedule(std::coroutine_handle<> handle) { ready.push_back(handle); }
+
+    /** removes `handle` from the queue if it is in there, for coroutines that are destroyed before they finish */
+    void cancel(std::coroutine_handle<> handle);
+
+    /** resumes queued coroutines until there are none left */
+    void run();
+
+    bool empty() const { return ready.empty(); }
+
+    /**
+     * lookupBatch - look up all `keys` with interleaved lookups, at most `maxInFlight` at once (0 counts as 1).
+     * The result for keys[i] is stored in values[i].
+     */
+    static void lookupBatch(ART &tree, std::span<const Key> keys, std::span<Value> values, std::size_t maxInFlight = 16);
+
+private:
+    std::deque<std::coroutine_handle<>> ready;
+};
+
+/** Prefetches `address` and gives the other lookups of this thread a turn until it has (hopefully) arrived. */
+struct PrefetchAwaiter {
+    const void *address;
+
+    bool await_ready() const noexcept {
+        if (address == nullptr) {
+            return true;
+        }
+        __builtin_prefetch(address);
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> handle) const { LookupScheduler::current().schedule(handle); }
+
+    void await_resume() const noexcept {}
+};
+
+/**
+ * Result of ART::lookup_async. The lookup does not start before it is awaited (or resumed by lookupBatch). Awaiting it
+ * from another coroutine queues it in the scheduler of this thread and resumes the awaiting coroutine with the value
+ * once the lookup is done, so LookupScheduler::current().run() has to be called by the runtime of the thread.
+ * Destroying an unfinished task takes it out of that scheduler, so it has to happen on the thread that queued it.
+ */
+class LookupTask {
+public:
+    struct promise_type {
+        Value value = INVALID_VALUE;
+        std::coroutine_handle<> continuation;
+
+        LookupTask get_return_object() { return LookupTask{std::coroutine_handle<promise_type>::from_promise(*this)}; }
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        auto final_suspend() noexcept {
+            struct FinalAwaiter {
+                bool await_ready() noexcept { return false; }
+
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+                    auto continuation = handle.promise().continuation;
+                    return continuation ? continuation : std::noop_coroutine();
+                }
+
+                void await_resume() noexcept {}
+            };
+            return FinalAwaiter{};
+        }
+
+        void return_value(Value result) { value = result; }
+
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    explicit LookupTask(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+
+    LookupTask(LookupTask &&other) noexcept : handle(std::exchange(other.handle, {})) {}
+
+    LookupTask &operator=(LookupTask &&other) noexcept {
+        std::swap(handle, other.handle);
+        return *this;
+    }
+
+    LookupTask(const LookupTask &) = delete;
+
+    LookupTask &operator=(const LookupTask &) = delete;
+
+    ~LookupTask() {
+        if (handle) {
+            if (!handle.done()) {
+                // it may still wait for its turn, the scheduler must not resume a destroyed frame
+                LookupScheduler::current().cancel(handle);
+            }
+            handle.destroy();
+        }
+    }
+
+    bool done() const { return handle.done(); }
+
+    Value result() const { return handle.promise().value; }
+
+    std::coroutine_handle<> coroutine() const { return handle; }
+
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<> awaiting) {
+        handle.promise().continuation = awaiting;
+        LookupScheduler::current().schedule(handle);
+    }
+
+    Value await_resume() const { return result(); }
+
+private:
+    std::coroutine_handle<promise_type> handle;
+};
@@ -0,0 +1,309 @@
+#include "compact_art.hpp"
+
+#include "swar.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+#include "immintrin.h"
+
+template<typename T>
+uint32_t CompactART::Pool<T>::allocate() {
+    if (!freeList.empty()) {
+        auto index = freeList.back();
+        freeList.pop_back();
+        (*this)[index] = T{};
+        return index;
+    }
+    if (used > INDEX_MASK) {
+        // references have 29 bits for the index, a bigger one would turn into another type tag
+        throw std::length_error("compact tree pool is full");
+    }
+    if (used % BLOCK_SIZE == 0) {
+        blocks.push_back(std::make_unique<T[]>(BLOCK_SIZE));
+    }
+    return used++;
+}
+
+std::size_t CompactART::innerMemoryUsage() const {
+    return nodes4.memoryUsage() + nodes16.memoryUsage() + nodes48.memoryUsage() + nodes256.memoryUsage();
+}
+
+CompactART::Header &CompactART::headerOf(NodeRef reference) {
+    return const_cast<Header &>(std::as_const(*this).headerOf(reference));
+}
+
+const CompactART::Header &CompactART::headerOf(NodeRef reference) const {
+    auto const index = indexOf(reference);
+    switch (tagOf(reference)) {
+        case Tag::N4:
+            return nodes4[index].header;
+        case Tag::N16:
+            return nodes16[index].header;
+        case Tag::N48:
+            return nodes48[index].header;
+        default:
+            assert(tagOf(reference) == Tag::N256);
+            return nodes256[index].header;
+    }
+}
+
+CompactART::NodeRef *CompactART::findChild(NodeRef node, uint8_t partOfKey) {
+    return const_cast<NodeRef *>(std::as_const(*this).findChild(node, partOfKey));
+}
+
+const CompactART::NodeRef *CompactART::findChild(NodeRef node, uint8_t partOfKey) const {
+    auto const index = indexOf(node);
+    switch (tagOf(node)) {
+        case Tag::N4: {
+            auto const &node4 = nodes4[index];
+            auto const slot = findKeyByte4(node4.keys.data(), partOfKey, node4.header.numberOfChildren);
+            return slot >= 0 ? &node4.children[slot] : nullptr;
+        }
+        case Tag::N16: {
+            auto const &node16 = nodes16[index];
+            auto keys = _mm_loadu_si128(reinterpret_cast<const __m128i *>(node16.keys.data()));
+            auto cmp = _mm_cmpeq_epi8(keys, _mm_set1_epi8(static_cast<char>(partOfKey)));
+            auto matches = _mm_movemask_epi8(cmp) & ((1 << node16.header.numberOfChildren) - 1);
+            return matches != 0 ? &node16.children[__builtin_ctz(matches)] : nullptr;
+        }
+        case Tag::N48: {
+            auto const &node48 = nodes48[index];
+            auto const offset = node48.keys[partOfKey];
+            return offset != Node48::EMPTY_INDEX ? &node48.children[offset] : nullptr;
+        }
+        default: {
+            assert(tagOf(node) == Tag::N256);
+            auto const &child = nodes256[index].children[partOfKey];
+            return child != EMPTY ? &child : nullptr;
+        }
+    }
+}
+
+void CompactART::addChild(NodeRef node, uint8_t partOfKey, NodeRef child) {
+    auto const index = indexOf(node);
+    switch (tagOf(node)) {
+        case Tag::N4: {
+            auto &node4 = nodes4[index];
+            node4.keys[node4.header.numberOfChildren] = partOfKey;
+            node4.children[node4.header.numberOfChildren++] = child;
+            break;
+        }
+        case Tag::N16: {
+            auto &node16 = nodes16[index];
+            node16.keys[node16.header.numberOfChildren] = partOfKey;
+            node16.children[node16.header.numberOfChildren++] = child;
+            break;
+        }
+        case Tag::N48: {
+            auto &node48 = nodes48[index];
+            node48.keys[partOfKey] = static_cast<uint8_t>(node48.header.numberOfChildren);
+            node48.children[node48.header.numberOfChildren++] = child;
+            break;
+        }
+        default: {
+            auto &node256 = nodes256[index];
+            node256.children[partOfKey] = child;
+            node256.header.numberOfChildren++;
+            break;
+        }
+    }
+}
+
+bool CompactART::isFull(NodeRef node) const {
+    auto const children = headerOf(node).numberOfChildren;
+    switch (tagOf(node)) {
+        case Tag::N4:
+            return children == 4;
+        case Tag::N16:
+            return children == 16;
+        case Tag::N48:
+            return children == 48;
+        default:
+            return children == 256;
+    }
+}
+
+CompactART::NodeRef CompactART::grow(NodeRef node) {
+    auto const index = indexOf(node);
+    switch (tagOf(node)) {
+        case Tag::N4: {
+            auto const grown = makeRef(Tag::N16, nodes16.allocate());
+            auto const &node4 = nodes4[index];
+            auto &node16 = nodes16[indexOf(grown)];
+            node16.header = node4.header;
+            std::copy(node4.keys.begin(), node4.keys.end(), node16.keys.begin());
+            std::copy(node4.children.begin(), node4.children.end(), node16.children.begin());
+            nodes4.free(index);
+            return grown;
+        }
+        case Tag::N16: {
+            auto const grown = makeRef(Tag::N48, nodes48.allocate());
+            auto const &node16 = nodes16[index];
+            auto &node48 = nodes48[indexOf(grown)];
+            node48.header = node16.header;
+            for (uint8_t i = 0; i < 16; i++) {
+                node48.keys[node16.keys[i]] = i;
+                node48.children[i] = node16.children[i];
+            }
+            nodes16.free(index);
+            return grown;
+        }
+        default: {
+            assert(tagOf(node) == Tag::N48);
+            auto const grown = makeRef(Tag::N256, nodes256.allocate());
+            auto const &node48 = nodes48[index];
+            auto &node256 = nodes256[indexOf(grown)];
+            node256.header = node48.header;
+            for (uint16_t i = 0; i < 256; i++) {
+                if (auto offset = node48.keys[i]; offset != Node48::EMPTY_INDEX) {
+                    node256.children[i] = node48.children[offset];
+                }
+            }
+            nodes48.free(index);
+            return grown;
+        }
+    }
+}
+
+CompactART::NodeRef CompactART::newNode4(const uint8_t *prefix, uint8_t prefixLength) {
+    auto const node = makeRef(Tag::N4, nodes4.allocate());
+    auto &header = nodes4[indexOf(node)].header;
+    header.prefixLength = prefixLength;
+    std::memcpy(header.prefix.data(), prefix, prefixLength);
+    return node;
+}
+
+bool CompactART::insert(const Key &key, Value value) {
+    // the slot that holds `node`, the root or a child slot of its parent
+    NodeRef *slot = &root;
+    uint8_t depth = 0;
+
+    auto newLeaf = [&] {
+        auto const leaf = makeRef(Tag::Leaf, leaves.allocate());
+        leaves[indexOf(leaf)] = {key.key, value, key.key_len};
+        return leaf;
+    };
+
+    while (true) {
+        auto const node = *slot;
+        if (node == EMPTY) {
+            *slot = newLeaf();
+            return true;
+        }
+
+        if (tagOf(node) == Tag::Leaf) {
+            // lazy expansion, see ART::insert
+            auto const &existing = leaves[indexOf(node)];
+            uint8_t i = depth;
+            while (i < key.key_len && i < existing.keyLength && key.key[i] == existing.key[i]) {
+                i++;
+            }
+            if (i == key.key_len || i == existing.keyLength) {
+                return false;
+            }
+            auto const existingByte = existing.key[i];
+            auto const newNode = newNode4(key.key.data() + depth, i - depth);
+            addChild(newNode, existingByte, node);
+            addChild(newNode, key.key[i], newLeaf());
+            *slot = newNode;
+            return true;
+        }
+
+        auto &header = headerOf(node);
+        uint8_t p = 0;
+        while (p < header.prefixLength && depth + p < key.key_len && header.prefix[p] == key.key[depth + p]) {
+            p++;
+        }
+        if (p != header.prefixLength) {
+            if (depth + p >= key.key_len) {
+                return false;
+            }
+            // split the compressed path, the old node keeps the rest of its prefix
+            auto const newNode = newNode4(header.prefix.data(), p);
+            addChild(newNode, header.prefix[p], node);
+            addChild(newNode, key.key[depth + p], newLeaf());
+            header.prefixLength = header.prefixLength - (p + 1);
+            std::memmove(header.prefix.data(), header.prefix.data() + p + 1, header.prefixLength);
+            *slot = newNode;
+            return true;
+        }
+
+        depth = depth + header.prefixLength;
+        if (depth >= key.key_len) {
+            return false;
+        }
+        if (auto *next = findChild(node, key.key[depth])) {
+            slot = next;
+            depth++;
+            continue;
+        }
+        auto target = node;
+        if (isFull(node)) {
+            target = grow(node);
+            *slot = target;
+        }
+        addChild(target, key.key[depth], newLeaf());
+        return true;
+    }
+}
+
+Value CompactART::lookup(const Key &key) const {
+    auto node = root;
+    uint8_t depth = 0;
+    while (node != EMPTY) {
+        if (tagOf(node) == Tag::Leaf) {
+            // prefixes are skipped optimistically, so the whole key has to match
+            auto const &leaf = leaves[indexOf(node)];
+            return leaf.keyLength == key.key_len && std::memcmp(leaf.key.data(), key.key.data(), key.key_len) == 0
+                   ? leaf.value : INVALID_VALUE;
+        }
+        depth = depth + headerOf(node).prefixLength + 1;
+        if (depth > key.key_len) {
+            return INVALID_VALUE;
+        }
+        auto const *slot = findChild(node, key.key[depth - 1]);
+        node = slot != nullptr ? *slot : EMPTY;
+    }
+    return INVALID_VALUE;
+}
+
+void CompactART::forEachEntry(const EntryVisitor &visitor) const {
+    auto visit = [&](auto &self, NodeRef node) -> void {
+        if (node == EMPTY) {
+            return;
+        }
+        if (tagOf(node) == Tag::Leaf) {
+            auto const &leaf = leaves[indexOf(node)];
+            Key key{};
+            key.key = leaf.key;
+            key.key_len = leaf.keyLength;
+            visitor(key, leaf.value);
+            return;
+        }
+        auto const index = indexOf(node);
+        switch (tagOf(node)) {
+            case Tag::N4:
+                for (uint16_t i = 0; i < nodes4[index].header.numberOfChildren; i++) {
+                    self(self, nodes4[index].children[i]);
+                }
+                break;
+            case Tag::N16:
+                for (uint16_t i = 0; i < nodes16[index].header.numberOfChildren; i++) {
+                    self(self, nodes16[index].children[i]);
+                }
+                break;
+            case Tag::N48:
+                for (uint16_t i = 0; i < nodes48[index].header.numberOfChildren; i++) {
+                    self(self, nodes48[index].children[i]);
+                }
+                break;
+            default:
+                for (auto child: nodes256[index].children) {
+                    self(self, child);
+                }
+                break;
+        }
+    };
+    visit(visit, root);
+}
@@ -0,0 +1,167 @@
+#pragma once
+
+#include "key.hpp"
+#include "key_utils.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/**
+ * Memory compact variant of the ART for trees below a few billion entries. Nodes and leaves live in one pool per type
+ * and reference each other by 32 bit references instead of pointers:
+ *
+ *  - reference: type tag (3 bit) | index into the pool of that type (29 bit), 0 is the empty reference
+ *  - inner nodes: prefix length, number of children and the prefix (10 bytes), then keys and references as in the ART
+ *  - leaves: only key, key length and value, no node header, no vtable
+ *
+ * A child slot takes half the space, so a Node4 fits into 32 bytes (half a cache line) and a Node256 into ~1 KB instead
+ * of 2 KB. Each pool holds up to 2^29 elements, i.e. 12 GB of leaves and 512 GB of Node256s.
+ * Same semantics as ART::insert / ART::lookup, but none of the optional modes of the ART.
+ */
+class CompactART {
+public:
+    using NodeRef = uint32_t;
+
+    enum class Tag : uint8_t {
+        Empty = 0, Leaf = 1, N4 = 2, N16 = 3, N48 = 4, N256 = 5
+    };
+
+    static constexpr uint32_t TAG_SHIFT = 29;
+    static constexpr uint32_t INDEX_MASK = (uint32_t{1} << TAG_SHIFT) - 1;
+    static constexpr NodeRef EMPTY = 0;
+
+    static Tag tagOf(NodeRef reference) { return static_cast<Tag>(reference >> TAG_SHIFT); }
+
+    static uint32_t indexOf(NodeRef reference) { return reference & INDEX_MASK; }
+
+    static NodeRef makeRef(Tag tag, uint32_t index) { return (uint32_t{static_cast<uint8_t>(tag)} << TAG_SHIFT) | index; }
+
+    struct Header {
+        // up to 256, one more than fits into a byte
+        uint16_t numberOfChildren = 0;
+        uint8_t prefixLength = 0;
+        // keys have at most 8 bytes and a node consumes one -> the prefix is at most 7 bytes
+        std::array<uint8_t, 7> prefix{};
+    };
+
+    struct Leaf {
+        std::array<uint8_t, 8> key;
+        Value value;
+        uint8_t keyLength;
+    };
+
+    struct Node4 {
+        Header header;
+        std::array<uint8_t, 4> keys{};
+        std::array<NodeRef, 4> children{};
+    };
+
+    struct Node16 {
+        Header header;
+        std::array<uint8_t, 16> keys{};
+        std::array<NodeRef, 16> children{};
+    };
+
+    struct Node48 {
+        Header header;
+        std::array<uint8_t, 256> keys;
+        std::array<NodeRef, 48> children{};
+
+        Node48() { keys.fill(EMPTY_INDEX); }
+
+        static constexpr uint8_t EMPTY_INDEX = 0xFF;
+    };
+
+    struct Node256 {
+        Header header;
+        std::array<NodeRef, 256> children{};
+    };
+
+    /**
+     * Elements of one type in blocks of fixed size, so they never move and references into a pool stay valid while it
+     * grows. Freed elements are reused before the pool grows.
+     */
+    template<typename T>
+    class Pool {
+    public:
+        // about 64 KB per block, a power of two so the index splits with a shift
+        static constexpr uint32_t BLOCK_SIZE = std::bit_floor(std::max<std::size_t>(1, 65536 / sizeof(T)));
+
+        T &operator[](uint32_t index) { return blocks[index / BLOCK_SIZE][index % BLOCK_SIZE]; }
+
+        const T &operator[](uint32_t index) const { return blocks[index / BLOCK_SIZE][index % BLOCK_SIZE]; }
+
+        /** index of a default constructed element, throws std::length_error once all 2^29 indexes are used */
+        uint32_t allocate();
+
+        void free(uint32_t index) { freeList.push_back(index); }
+
+        /** elements in use */
+        std::size_t size() const { return used - freeList.size(); }
+
+        std::size_t memoryUsage() const { return blocks.size() * BLOCK_SIZE * sizeof(T); }
+
+    private:
+        std::vector<std::unique_ptr<T[]>> blocks;
+        std::vector<uint32_t> freeList;
+        uint32_t used = 0;
+    };
+
+    /** same as ART::insert, throws std::length_error if a pool has no index left for the new leaf or node */
+    bool insert(const Key &key, Value value);
+
+    /** same as ART::lookup */
+    Value lookup(const Key &key) const;
+
+    /** calls `visitor` for every key/value pair in the tree (in no particular order) */
+    void forEachEntry(const EntryVisitor &visitor) const;
+
+    std::size_t size() const { return leaves.size(); }
+
+    /** bytes reserved by the leaf pool */
+    std::size_t leafMemoryUsage() const { return leaves.memoryUsage(); }
+
+    /** bytes reserved by the inner node pools */
+    std::size_t innerMemoryUsage() const;
+
+    NodeRef getRoot() const { return root; }
+
+    /** header of an inner node */
+    const Header &headerOf(NodeRef reference) const;
+
+private:
+    Header &headerOf(NodeRef reference);
+
+    /** slot that holds the child for `partOfKey`, nullptr if there is none */
+    NodeRef *findChild(NodeRef node, uint8_t partOfKey);
+
+    const NodeRef *findChild(NodeRef node, uint8_t partOfKey) const;
+
+    /** adds a child to a node that is not full */
+    void addChild(NodeRef node, uint8_t partOfKey, NodeRef child);
+
+    bool isFull(NodeRef node) const;
+
+    /** copies `node` into the next bigger node type and frees it */
+    NodeRef grow(NodeRef node);
+
+    /** an empty node4 with the first `prefixLength` bytes of `prefix` */
+    NodeRef newNode4(const uint8_t *prefix, uint8_t prefixLength);
+
+    NodeRef root = EMPTY;
+
+    Pool<Leaf> leaves;
+    Pool<Node4> nodes4;
+    Pool<Node16> nodes16;
+    Pool<Node48> nodes48;
+    Pool<Node256> nodes256;
+};
+
+static_assert(sizeof(CompactART::Header) == 10, "the node header has no padding");
+static_assert(sizeof(CompactART::Node4) == 32, "a compact node4 is half a cache line");
+static_assert(sizeof(CompactART::Leaf) == 24, "a compact leaf has no node header");
@@ -0,0 +1,117 @@
+#include "fingerprint_table.hpp"
+
+#include "art.hpp"
+
+#include <bit>
+#include "immintrin.h"
+
+FingerprintTable::FingerprintTable(std::size_t budgetBytes) {
+    auto const numberOfBuckets = std::bit_floor(std::max<std::size_t>(budgetBytes / sizeof(Bucket), 1));
+    buckets = std::make_unique<Bucket[]>(numberOfBuckets);
+    bucketMask = numberOfBuckets - 1;
+}
+
+uint64_t FingerprintTable::hash(const Key &key) {
+    // bytes behind key_len may be stale, so we mask them out
+    uint64_t word;
+    std::memcpy(&word, key.key.data(), sizeof(word));
+    if (key.key_len < 8) {
+        word &= (uint64_t{1} << (8 * key.key_len)) - 1;
+    }
+    // murmur3 finalizer
+    uint64_t h = word ^ (uint64_t{key.key_len} << 56);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+uint32_t FingerprintTable::matchingSlots(uint64_t fingerprints, uint8_t fingerprint) {
+    auto cmp = _mm_cmpeq_epi8(_mm_cvtsi64_si128(static_cast<int64_t>(fingerprints)),
+                              _mm_set1_epi8(static_cast<char>(fingerprint)));
+    return static_cast<uint32_t>(_mm_movemask_epi8(cmp)) & ((1u << SLOTS_PER_BUCKET) - 1);
+}
+
+void FingerprintTable::storeFingerprint(Bucket &bucket, uint8_t slot, uint8_t fingerprint) {
+    auto const shift = 8 * slot;
+    auto word = bucket.fingerprints.load(std::memory_order_relaxed);
+    // release: whoever sees the fingerprint also sees the leaf pointer stored before it
+    while (!bucket.fingerprints.compare_exchange_weak(
+            word, (word & ~(uint64_t{0xFF} << shift)) | (uint64_t{fingerprint} << shift), std::memory_order_release,
+            std::memory_order_relaxed)) {}
+}
+
+// the top byte selects the fingerprint, the low bits the bucket -> independent as long as we have < 2^56 buckets
+static uint8_t fingerprintOf(uint64_t h) {
+    auto fingerprint = static_cast<uint8_t>(h >> 56);
+    return fingerprint == 0 ? 1 : fingerprint;
+}
+
+LeafNode *FingerprintTable::find(const Key &key) const {
+    auto const h = hash(key);
+    auto const &bucket = buckets[h & bucketMask];
+    auto const fingerprints = bucket.fingerprints.load(std::memory_order_acquire);
+    for (auto matches = matchingSlots(fingerprints, fingerprintOf(h)); matches != 0; matches &= matches - 1) {
+        // a concurrent fill may have put another leaf (or none yet) into the slot since, the key check catches it
+        auto *leaf = bucket.leaves[__builtin_ctz(matches)].load(std::memory_order_acquire);
+        if (leaf != nullptr && leaf->key == key) {
+            return leaf;
+        }
+    }
+    return nullptr;
+}
+
+void FingerprintTable::insert(const Key &key, LeafNode *leaf) {
+    auto const h = hash(key);
+    auto const fingerprint = fingerprintOf(h);
+    auto &bucket = buckets[h & bucketMask];
+    auto const fingerprints = bucket.fingerprints.load(std::memory_order_acquire);
+
+    // two lookups that missed the same key may both have filled a slot for it, all of them get the new leaf
+    bool replaced = false;
+    for (auto matches = matchingSlots(fingerprints, fingerprint); matches != 0; matches &= matches - 1) {
+        auto slot = __builtin_ctz(matches);
+        auto const *existing = bucket.leaves[slot].load(std::memory_order_acquire);
+        if (existing != nullptr && existing->key == key) {
+            bucket.leaves[slot].store(leaf, std::memory_order_release);
+            replaced = true;
+        }
+    }
+    if (replaced) {
+        return;
+    }
+
+    uint8_t slot;
+    if (auto empty = matchingSlots(fingerprints, EMPTY)) {
+        slot = static_cast<uint8_t>(__builtin_ctz(empty));
+    } else {
+        // bucket is full -> evict some entry, the hash bits in the middle are as good as a random number
+        slot = static_cast<uint8_t>(((h >> 24) & 0xFFFF) % SLOTS_PER_BUCKET);
+    }
+    // leaf first: a probe that matches the new fingerprint must not find the old leaf or an empty slot
+    bucket.leaves[slot].store(leaf, std::memory_order_release);
+    storeFingerprint(bucket, slot, fingerprint);
+}
+
+void FingerprintTable::erase(const Key &key, const LeafNode *leaf) {
+    auto &bucket = buckets[hash(key) & bucketMask];
+    // racing fills may have left the leaf in more than one slot, or behind the fingerprint of another key, so we check
+    // the pointers of all slots and not only those with a matching fingerprint
+    for (uint8_t slot = 0; slot < SLOTS_PER_BUCKET; slot++) {
+        if (bucket.leaves[slot].load(std::memory_order_relaxed) == leaf) {
+            storeFingerprint(bucket, slot, EMPTY);
+            bucket.leaves[slot].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+}
+
+void FingerprintTable::clear() {
+    for (uint64_t i = 0; i <= bucketMask; i++) {
+        buckets[i].fingerprints.store(0, std::memory_order_relaxed);
+        for (auto &leaf: buckets[i].leaves) {
+            leaf.store(nullptr, std::memory_order_relaxed);
+        }
+    }
+}
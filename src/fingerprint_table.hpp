@@ -0,0 +1,66 @@
+#pragma once
+
+#include "key.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+class LeafNode;
+
+/**
+ * Bounded hash table in front of the tree for point lookups. Every bucket is exactly one cache line: 7 one byte
+ * fingerprints plus 7 leaf pointers. A probe compares all fingerprints of the bucket with one SSE compare, so a hit
+ * costs the bucket line plus the leaf line.
+ *
+ * This is only a cache: when a bucket is full, a pseudo random entry is overwritten and the key has to be found
+ * through the tree again. There is no chaining and no resizing, the memory stays within the configured budget.
+ *
+ * Lookups under a shared lock fill the table concurrently with each other. A slot is published by storing the leaf
+ * pointer first and then the fingerprint (release), a probe loads the fingerprints with acquire and checks the key of
+ * the leaf it gets, so racing fills at worst overwrite each other's entry and cost a miss.
+ */
+class FingerprintTable {
+public:
+    /** uses the largest power of two number of buckets that fits into `budgetBytes` (at least one) */
+    explicit FingerprintTable(std::size_t budgetBytes);
+
+    /** returns the leaf for `key` or nullptr if it is not cached */
+    LeafNode *find(const Key &key) const;
+
+    /** caches `leaf` for `key`, replaces all older entries for the same key. May run concurrently with find and insert. */
+    void insert(const Key &key, LeafNode *leaf);
+
+    /** drops every entry that points to `leaf` (of `key`), needed before leaves are freed. Needs the table exclusively. */
+    void erase(const Key &key, const LeafNode *leaf);
+
+    void clear();
+
+    std::size_t memoryUsage() const { return (bucketMask + 1) * sizeof(Bucket); }
+
+private:
+    static constexpr uint8_t SLOTS_PER_BUCKET = 7;
+    // fingerprint 0 marks an empty slot
+    static constexpr uint8_t EMPTY = 0;
+
+    struct alignas(64) Bucket {
+        // one fingerprint byte per slot, the 8th byte is padding and always EMPTY. One word, so a probe loads all of
+        // them atomically.
+        std::atomic<uint64_t> fingerprints{0};
+        std::array<std::atomic<LeafNode *>, SLOTS_PER_BUCKET> leaves{};
+    };
+
+    static_assert(sizeof(Bucket) == 64);
+
+    static uint64_t hash(const Key &key);
+
+    /** bit i is set if slot i of `fingerprints` (a Bucket::fingerprints word) has `fingerprint` */
+    static uint32_t matchingSlots(uint64_t fingerprints, uint8_t fingerprint);
+
+    /** sets the fingerprint of `slot`, leaves the other slots of the bucket alone */
+    static void storeFingerprint(Bucket &bucket, uint8_t slot, uint8_t fingerprint);
+
+    std::unique_ptr<Bucket[]> buckets;
+    uint64_t bucketMask;
+};
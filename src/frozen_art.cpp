@@ -0,0 +1,203 @@
+#include "frozen_art.hpp"
+
+#include "art.hpp"
+#include "swar.hpp"
+
+#include <deque>
+#include <stdexcept>
+#include <unordered_map>
+#include "immintrin.h"
+
+FrozenART::FrozenART(const Node *treeRoot) {
+    if (treeRoot == nullptr) {
+        return;
+    }
+
+    // leaves are numbered in key order, so every subtree covers a contiguous range of the columns
+    std::unordered_map<const Node *, uint32_t> leafNumbers;
+    auto numberLeaves = [&](auto &self, const Node *node) -> void {
+        if (node->isLeafNode) {
+            auto const *leaf = dynamic_cast<const LeafNode *>(node);
+            leafNumbers[node] = static_cast<uint32_t>(values.size());
+            keyBytes.push_back(leaf->key.key);
+            keyLengths.push_back(leaf->key.key_len);
+            values.push_back(leaf->value);
+            return;
+        }
+        for (auto const &[partOfKey, child]: ART::childrenInKeyOrder(node)) {
+            self(self, child);
+        }
+    };
+    numberLeaves(numberLeaves, treeRoot);
+    // LEAF_TAG | number must not collide with EMPTY
+    if (values.size() >= LEAF_TAG - 1) {
+        throw std::length_error("too many leaves for a frozen tree");
+    }
+
+    if (treeRoot->isLeafNode) {
+        root = LEAF_TAG;
+        return;
+    }
+
+    auto sizeInWords = [](uint16_t numberOfChildren) -> uint32_t {
+        if (numberOfChildren <= TINY_CHILDREN) {
+            return 1 + 1 + numberOfChildren;
+        }
+        if (numberOfChildren <= SMALL_CHILDREN) {
+            return 1 + 4 + numberOfChildren;
+        }
+        return 1 + 8 + 2 + numberOfChildren;
+    };
+
+    // breadth first: a node gets its offset when it is queued, so offsets grow in the order the nodes are written
+    std::deque<std::pair<const Node *, uint32_t>> queue;
+    root = 0;
+    uint32_t nextOffset = sizeInWords(treeRoot->numberOfChildren);
+    queue.emplace_back(treeRoot, root);
+
+    while (!queue.empty()) {
+        auto [node, offset] = queue.front();
+        queue.pop_front();
+
+        auto children = ART::childrenInKeyOrder(node);
+        auto const count = static_cast<uint16_t>(children.size());
+        assert(count == node->numberOfChildren);
+        // + 4 words of slack, so the 16 byte SIMD load of a small node at the very end stays inside the buffer
+        nodes.resize(std::max<std::size_t>(nodes.size(), nextOffset + 4), 0);
+
+        Kind kind;
+        uint32_t childrenOffset;
+        if (count <= TINY_CHILDREN) {
+            kind = Kind::Tiny;
+            childrenOffset = offset + 2;
+            auto *keys = reinterpret_cast<uint8_t *>(&nodes[offset + 1]);
+            for (uint16_t i = 0; i < count; i++) {
+                keys[i] = children[i].first;
+            }
+        } else if (count <= SMALL_CHILDREN) {
+            kind = Kind::Small;
+            childrenOffset = offset + 5;
+            auto *keys = reinterpret_cast<uint8_t *>(&nodes[offset + 1]);
+            for (uint16_t i = 0; i < count; i++) {
+                keys[i] = children[i].first;
+            }
+        } else {
+            kind = Kind::Bitmap;
+            childrenOffset = offset + 11;
+            std::array<uint64_t, 4> bitmap{};
+            for (auto const &[partOfKey, child]: children) {
+                bitmap[partOfKey >> 6] |= uint64_t{1} << (partOfKey & 63);
+            }
+            std::array<uint16_t, 4> rank{};
+            for (uint8_t block = 1; block < 4; block++) {
+                rank[block] = rank[block - 1] + std::popcount(bitmap[block - 1]);
+            }
+            std::memcpy(&nodes[offset + 1], bitmap.data(), sizeof(bitmap));
+            std::memcpy(&nodes[offset + 9], rank.data(), sizeof(rank));
+        }
+        nodes[offset] = static_cast<uint32_t>(kind) | (uint32_t{node->prefixLength} << 8) | (uint32_t{count} << 16);
+
+        for (uint16_t i = 0; i < count; i++) {
+            auto const *child = children[i].second;
+            if (child->isLeafNode) {
+                nodes[childrenOffset + i] = LEAF_TAG | leafNumbers[child];
+            } else {
+                nodes[childrenOffset + i] = nextOffset;
+                queue.emplace_back(child, nextOffset);
+                nextOffset += sizeInWords(child->numberOfChildren);
+                // offsets share the references with leaf numbers, the top bit marks a leaf
+                if (nextOffset + 4 >= LEAF_TAG) {
+                    throw std::length_error("too many inner nodes for a frozen tree");
+                }
+            }
+        }
+    }
+    nodes.resize(nextOffset + 4);
+    nodes.shrink_to_fit();
+}
+
+uint32_t FrozenART::findChild(uint32_t offset, uint8_t partOfKey) const {
+    auto const header = nodes[offset];
+    auto const kind = static_cast<Kind>(header & 0xFF);
+    auto const count = header >> 16;
+
+    if (kind == Kind::Tiny) {
+        auto const index = findKeyByte4(reinterpret_cast<const uint8_t *>(&nodes[offset + 1]), partOfKey, count);
+        return index >= 0 ? nodes[offset + 2 + index] : EMPTY;
+    }
+
+    if (kind == Kind::Small) {
+        auto keys = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&nodes[offset + 1]));
+        auto cmp = _mm_cmpeq_epi8(keys, _mm_set1_epi8(static_cast<char>(partOfKey)));
+        auto matches = static_cast<uint32_t>(_mm_movemask_epi8(cmp)) & ((1u << count) - 1);
+        return matches != 0 ? nodes[offset + 5 + __builtin_ctz(matches)] : EMPTY;
+    }
+
+    uint64_t bits;
+    std::memcpy(&bits, &nodes[offset + 1 + 2 * (partOfKey >> 6)], sizeof(bits));
+    auto const bit = partOfKey & 63;
+    if (((bits >> bit) & 1) == 0) {
+        return EMPTY;
+    }
+    uint16_t rank;
+    std::memcpy(&rank, reinterpret_cast<const uint8_t *>(&nodes[offset + 9]) + 2 * (partOfKey >> 6), sizeof(rank));
+    auto const index = rank + std::popcount(bits & ((uint64_t{1} << bit) - 1));
+    return nodes[offset + 11 + index];
+}
+
+Key FrozenART::keyAt(std::size_t leaf) const {
+    Key key{};
+    key.key = keyBytes[leaf];
+    key.key_len = keyLengths[leaf];
+    return key;
+}
+
+Value FrozenART::lookup(const Key &key) const {
+    auto reference = root;
+    uint8_t depth = 0;
+
+    while (reference != EMPTY) {
+        if (reference & LEAF_TAG) {
+            auto const leaf = reference & ~LEAF_TAG;
+            return keyAt(leaf) == key ? values[leaf] : INVALID_VALUE;
+        }
+
+        // prefix bytes are skipped optimistically, the leaf check above covers them
+        depth = depth + static_cast<uint8_t>(nodes[reference] >> 8);
+        if (depth >= key.key_len) {
+            return INVALID_VALUE;
+        }
+        reference = findChild(reference, key[depth]);
+        depth++;
+    }
+    return INVALID_VALUE;
+}
+
+std::size_t FrozenART::lowerBound(const Key &key) const {
+    std::size_t low = 0;
+    std::size_t high = values.size();
+    while (low < high) {
+        auto const middle = low + (high - low) / 2;
+        if (compareKeys(keyAt(middle), key) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+void FrozenART::scan(const Key &from, const Key &to, const EntryVisitor &visitor) const {
+    for (auto leaf = lowerBound(from); leaf < values.size(); leaf++) {
+        auto key = keyAt(leaf);
+        if (compareKeys(key, to) > 0) {
+            return;
+        }
+        visitor(key, values[leaf]);
+    }
+}
+
+std::size_t FrozenART::memoryUsage() const {
+    return nodes.size() * sizeof(uint32_t) + keyBytes.size() * sizeof(keyBytes[0]) + keyLengths.size() +
+           values.size() * sizeof(Value);
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "key.hpp"
+#include "key_utils.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class Node;
+
+/**
+ * Immutable, read optimized copy of an ART (see ART::freeze). All inner nodes live breadth first in one buffer of
+ * 32 bit words and reference each other by 32 bit word offsets:
+ *
+ *  - header word: kind (8 bit), prefix length (8 bit), number of children (16 bit)
+ *  - Tiny   (up to 4 children):  1 word of sorted key bytes, then the children
+ *  - Small  (up to 16 children): 4 words of sorted key bytes, then the children
+ *  - Bitmap (more children):     256 bit bitmap (8 words), rank before each 64 bit block (2 words), then the children
+ *
+ * Prefix bytes are not stored at all: lookups skip them and compare the full key at the leaf anyway.
+ * Leaves are numbered in key order and stored as columns (key bytes, key length, value), a child reference with the
+ * top bit set is a leaf number. Because the leaves are sorted, range scans are a binary search plus a linear pass.
+ * References have 31 bits, so a tree with 2^31 - 1 or more leaves or node words cannot be frozen.
+ */
+class FrozenART {
+public:
+    FrozenART() = default;
+
+    /** copies the tree below `root`, throws std::length_error if it does not fit into 31 bit references */
+    explicit FrozenART(const Node *root);
+
+    /** same as ART::lookup */
+    Value lookup(const Key &key) const;
+
+    /** calls `visitor` for all entries with from <= key <= to in key order */
+    void scan(const Key &from, const Key &to, const EntryVisitor &visitor) const;
+
+    std::size_t size() const { return values.size(); }
+
+    /** bytes used by the node buffer and the leaf columns */
+    std::size_t memoryUsage() const;
+
+private:
+    enum class Kind : uint8_t {
+        Tiny = 0, Small = 1, Bitmap = 2
+    };
+
+    static constexpr uint32_t LEAF_TAG = uint32_t{1} << 31;
+    static constexpr uint32_t EMPTY = ~uint32_t{0};
+
+    static constexpr uint8_t TINY_CHILDREN = 4;
+    static constexpr uint8_t SMALL_CHILDREN = 16;
+
+    /** reference of the child for `partOfKey` in the node at word offset `offset`, EMPTY if there is none */
+    uint32_t findChild(uint32_t offset, uint8_t partOfKey) const;
+
+    Key keyAt(std::size_t leaf) const;
+
+    /** index of the first leaf that is not smaller than `key` */
+    std::size_t lowerBound(const Key &key) const;
+
+    std::vector<uint32_t> nodes;
+    uint32_t root = EMPTY;
+
+    std::vector<std::array<uint8_t, 8>> keyBytes;
+    std::vector<uint8_t> keyLengths;
+    std::vector<Value> values;
+};
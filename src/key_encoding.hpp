@@ -0,0 +1,203 @@
+#pragma once
+
+#include "key.hpp"
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <string_view>
+#include "immintrin.h"
+
+/**
+ * Order preserving encodings on top of Key. Every encoded column compares bytewise (memcmp) in the same order as the
+ * original values, so keys built from several columns sort like the tuple of their columns:
+ *
+ *  - unsigned integers are stored big-endian (like Key::set_int)
+ *  - signed integers get their sign bit flipped, so negative values sort before positive ones
+ *  - floats/doubles flip all bits if negative and only the sign bit otherwise, -0.0 is stored as 0.0
+ *  - nullable columns get a one byte marker in front, NULL sorts before every value
+ *  - strings escape 0x00 as 0x00 0xFF and end with 0x00 0x00, so no encoded key is a prefix of another one
+ *
+ * Keep in mind that a Key has room for 8 bytes only. If the columns do not fit, the builder is marked as overflowed and
+ * build() throws std::length_error instead of returning a truncated key.
+ */
+class KeyBuilder {
+public:
+    static constexpr uint8_t NULL_MARKER = 0x00;
+    static constexpr uint8_t NOT_NULL_MARKER = 0x01;
+
+    KeyBuilder &add(uint32_t value) { return append(__builtin_bswap32(value)); }
+
+    KeyBuilder &add(uint64_t value) { return append(__builtin_bswap64(value)); }
+
+    KeyBuilder &add(int32_t value) { return add(static_cast<uint32_t>(value) ^ (uint32_t{1} << 31)); }
+
+    KeyBuilder &add(int64_t value) { return add(static_cast<uint64_t>(value) ^ (uint64_t{1} << 63)); }
+
+    KeyBuilder &add(float value) {
+        // -0.0 == 0.0, so they have to get the same encoding
+        auto bits = std::bit_cast<uint32_t>(value == 0.0f ? 0.0f : value);
+        return add(bits & (uint32_t{1} << 31) ? ~bits : bits | (uint32_t{1} << 31));
+    }
+
+    KeyBuilder &add(double value) {
+        auto bits = std::bit_cast<uint64_t>(value == 0.0 ? 0.0 : value);
+        return add(bits & (uint64_t{1} << 63) ? ~bits : bits | (uint64_t{1} << 63));
+    }
+
+    KeyBuilder &add(std::string_view value) {
+        for (char c: value) {
+            appendByte(static_cast<uint8_t>(c));
+            if (c == '\0') {
+                appendByte(0xFF);
+            }
+        }
+        appendByte(0x00);
+        return appendByte(0x00);
+    }
+
+    KeyBuilder &addNull() { return appendByte(NULL_MARKER); }
+
+    /** nullable column: a marker byte followed by the value if there is one */
+    template<typename T>
+    KeyBuilder &add(const std::optional<T> &value) {
+        if (!value.has_value()) {
+            return addNull();
+        }
+        appendByte(NOT_NULL_MARKER);
+        return add(*value);
+    }
+
+    /** true if the columns did not fit into the 8 bytes of a key */
+    bool overflowed() const { return overflow; }
+
+    uint8_t size() const { return length; }
+
+    /** the encoded key, throws std::length_error if the columns did not fit */
+    Key build() const {
+        if (overflow) {
+            throw std::length_error("encoded columns do not fit into the 8 bytes of a key");
+        }
+        Key key{};
+        key.key = bytes;
+        key.key_len = length;
+        return key;
+    }
+
+private:
+    template<typename T>
+    KeyBuilder &append(T bigEndianValue) {
+        if (length + sizeof(T) > bytes.size()) {
+            overflow = true;
+            return *this;
+        }
+        std::memcpy(bytes.data() + length, &bigEndianValue, sizeof(T));
+        length += sizeof(T);
+        return *this;
+    }
+
+    KeyBuilder &appendByte(uint8_t byte) {
+        return append(byte);
+    }
+
+    std::array<uint8_t, 8> bytes{};
+    uint8_t length = 0;
+    bool overflow = false;
+};
+
+/** encodes all columns into one key, e.g. makeKey(int32_t{-5}, 1.5f). Throws std::length_error if they do not fit. */
+template<typename... Columns>
+Key makeKey(const Columns &... columns) {
+    KeyBuilder builder;
+    (builder.add(columns), ...);
+    return builder.build();
+}
+
+/** Reads back fixed width columns that were written by KeyBuilder, starting at the front of the key. */
+class KeyReader {
+public:
+    explicit KeyReader(const Key &key) : key(key) {}
+
+    uint32_t readUInt32() { return __builtin_bswap32(read<uint32_t>()); }
+
+    uint64_t readUInt64() { return __builtin_bswap64(read<uint64_t>()); }
+
+    int32_t readInt32() { return static_cast<int32_t>(readUInt32() ^ (uint32_t{1} << 31)); }
+
+    int64_t readInt64() { return static_cast<int64_t>(readUInt64() ^ (uint64_t{1} << 63)); }
+
+    float readFloat() {
+        auto bits = readUInt32();
+        return std::bit_cast<float>(bits & (uint32_t{1} << 31) ? bits ^ (uint32_t{1} << 31) : ~bits);
+    }
+
+    double readDouble() {
+        auto bits = readUInt64();
+        return std::bit_cast<double>(bits & (uint64_t{1} << 63) ? bits ^ (uint64_t{1} << 63) : ~bits);
+    }
+
+    /** reads the marker of a nullable column, returns false for NULL */
+    bool readNotNull() { return read<uint8_t>() != KeyBuilder::NULL_MARKER; }
+
+    std::string readString() {
+        std::string value;
+        while (true) {
+            auto c = read<uint8_t>();
+            if (c == 0x00) {
+                if (read<uint8_t>() == 0x00) {
+                    return value;
+                }
+                // escaped 0x00 0xFF
+                value.push_back('\0');
+            } else {
+                value.push_back(static_cast<char>(c));
+            }
+        }
+    }
+
+private:
+    template<typename T>
+    T read() {
+        assert(offset + sizeof(T) <= key.key_len);
+        T value;
+        std::memcpy(&value, key.key.data() + offset, sizeof(T));
+        offset += sizeof(T);
+        return value;
+    }
+
+    const Key &key;
+    uint8_t offset = 0;
+};
+
+/**
+ * Bulk encoding of 8 byte integer keys. `signMask` is xor-ed into every value before the byte swap
+ * (1 << 63 for int64_t, 0 for uint64_t). With AVX2 four keys are swapped with one shuffle.
+ */
+inline void encodeUInt64Batch(const uint64_t *values, Key *keys, std::size_t count, uint64_t signMask = 0) {
+    std::size_t i = 0;
+#ifdef __AVX2__
+    auto const reverseBytes = _mm256_setr_epi8(
+            7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+            7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    auto const sign = _mm256_set1_epi64x(static_cast<int64_t>(signMask));
+    alignas(32) std::array<uint64_t, 4> swapped{};
+    for (; i + 4 <= count; i += 4) {
+        auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(values + i));
+        v = _mm256_shuffle_epi8(_mm256_xor_si256(v, sign), reverseBytes);
+        _mm256_store_si256(reinterpret_cast<__m256i *>(swapped.data()), v);
+        for (std::size_t j = 0; j < 4; j++) {
+            std::memcpy(keys[i + j].key.data(), &swapped[j], sizeof(uint64_t));
+            keys[i + j].key_len = 8;
+        }
+    }
+#endif
+    for (; i < count; i++) {
+        keys[i].set_int(values[i] ^ signMask);
+    }
+}
+
+inline void encodeInt64Batch(const int64_t *values, Key *keys, std::size_t count) {
+    encodeUInt64Batch(reinterpret_cast<const uint64_t *>(values), keys, count, uint64_t{1} << 63);
+}
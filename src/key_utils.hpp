@@ -0,0 +1,18 @@
+#pragma once
+
+#include "key.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+
+/** receives the entries of a tree or a log, see ART::forEachEntry */
+using EntryVisitor = std::function<void(const Key &, Value)>;
+
+/** lexicographic byte order, a proper prefix sorts first */
+inline int compareKeys(const Key &a, const Key &b) {
+    if (auto cmp = std::memcmp(a.key.data(), b.key.data(), std::min(a.key_len, b.key_len)); cmp != 0) {
+        return cmp;
+    }
+    return static_cast<int>(a.key_len) - static_cast<int>(b.key_len);
+}
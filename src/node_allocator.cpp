@@ -0,0 +1,248 @@
+#include "node_allocator.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <map>
+#include <new>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+// we don't want to depend on libnuma just for these two syscalls
+constexpr int MPOL_BIND_MODE = 2;
+constexpr int MPOL_INTERLEAVE_MODE = 3;
+
+NodeAllocatorConfig NodeAllocator::config{};
+std::mutex NodeAllocator::mutex;
+std::atomic<bool> NodeAllocator::arenaEnabled{false};
+std::atomic<bool> NodeAllocator::chunksMapped{false};
+std::vector<NodeAllocator::Chunk> NodeAllocator::chunks;
+std::map<std::uintptr_t, std::size_t> NodeAllocator::chunkRanges;
+std::array<NodeAllocator::Arena, NodeAllocator::MAX_NUMA_NODES> NodeAllocator::arenas{};
+std::vector<void *> NodeAllocator::freeLists;
+std::size_t NodeAllocator::usedBytes = 0;
+thread_local uint16_t NodeAllocator::currentNumaNode = 0;
+
+void NodeAllocator::configure(const NodeAllocatorConfig &newConfig) {
+    std::lock_guard lock{mutex};
+    config = newConfig;
+    arenaEnabled.store(config.useArena, std::memory_order_release);
+    // already mapped chunks stay valid, we only start new ones with the new settings
+    std::ranges::fill(arenas, Arena{});
+}
+
+NodeAllocatorConfig NodeAllocator::getConfig() {
+    std::lock_guard lock{mutex};
+    return config;
+}
+
+uint16_t NodeAllocator::numberOfNumaNodes() {
+    static const uint16_t count = [] {
+        uint16_t nodes = 0;
+        std::error_code error;
+        for (auto const &entry: std::filesystem::directory_iterator("/sys/devices/system/node", error)) {
+            auto name = entry.path().filename().string();
+            if (name.starts_with("node") && name.size() > 4 && std::isdigit(name[4])) {
+                nodes++;
+            }
+        }
+        return static_cast<uint16_t>(std::clamp<uint16_t>(nodes, 1, MAX_NUMA_NODES));
+    }();
+    return count;
+}
+
+void NodeAllocator::setSubtree(uint8_t firstKeyByte) {
+    // only used with NumaPolicy::SubtreeBind, allocate() checks the policy under the mutex
+    currentNumaNode = static_cast<uint16_t>((firstKeyByte * numberOfNumaNodes()) / 256);
+}
+
+std::size_t NodeAllocator::chunkSize() {
+    return config.pageSize == PageSize::Huge1GB ? (std::size_t{1} << 30) : (std::size_t{1} << 21);
+}
+
+NodeAllocator::Chunk NodeAllocator::mapChunk(uint16_t numaNode) {
+    auto const size = chunkSize();
+    constexpr int protection = PROT_READ | PROT_WRITE;
+    constexpr int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+
+    void *memory = MAP_FAILED;
+    bool hugeTlb = false;
+    if (config.pageSize != PageSize::Default) {
+        int const hugeFlags = MAP_HUGETLB | ((config.pageSize == PageSize::Huge1GB ? 30 : 21) << MAP_HUGE_SHIFT);
+        // hugetlb mappings are always aligned to the huge page size. No MAP_NORESERVE here, otherwise the mapping
+        // succeeds without reserved pages and we get a SIGBUS on first touch.
+        memory = mmap(nullptr, size, protection, MAP_PRIVATE | MAP_ANONYMOUS | hugeFlags, -1, 0);
+        hugeTlb = memory != MAP_FAILED;
+    }
+
+    if (!hugeTlb) {
+        // no reserved huge pages -> map twice the size to align it ourselves and ask for transparent huge pages
+        auto *raw = static_cast<std::byte *>(mmap(nullptr, 2 * size, protection, flags, -1, 0));
+        if (raw == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        auto const address = reinterpret_cast<std::uintptr_t>(raw);
+        auto *aligned = reinterpret_cast<std::byte *>((address + size - 1) & ~(size - 1));
+        if (aligned != raw) {
+            munmap(raw, aligned - raw);
+        }
+        munmap(aligned + size, (raw + 2 * size) - (aligned + size));
+        memory = aligned;
+        if (config.pageSize != PageSize::Default) {
+            madvise(memory, size, MADV_HUGEPAGE);
+        }
+    }
+
+    // the policy has to be set before the first touch, placement is best effort -> ignore errors
+    auto const numaNodes = numberOfNumaNodes();
+    if (numaNodes > 1 && config.numaPolicy != NumaPolicy::FirstTouch) {
+        unsigned long mask = 0;
+        int mode;
+        if (config.numaPolicy == NumaPolicy::Interleave) {
+            mode = MPOL_INTERLEAVE_MODE;
+            mask = numaNodes >= 64 ? ~0ul : (1ul << numaNodes) - 1;
+        } else {
+            mode = MPOL_BIND_MODE;
+            mask = 1ul << numaNode;
+        }
+        syscall(SYS_mbind, memory, size, mode, &mask, sizeof(mask) * 8, 0);
+    }
+
+    return Chunk{static_cast<std::byte *>(memory), size, numaNode, hugeTlb};
+}
+
+void *NodeAllocator::allocate(std::size_t size) {
+    if (!arenaEnabled.load(std::memory_order_acquire)) {
+        return ::operator new(size);
+    }
+
+    std::unique_lock lock{mutex};
+    // blocks larger than a chunk (e.g. leaf blocks of big batches) are not worth an arena of their own. The flag may
+    // have been cleared in between, config is what counts.
+    if (!config.useArena || size > chunkSize()) {
+        lock.unlock();
+        return ::operator new(size);
+    }
+
+    auto const rounded = (size + SIZE_CLASS - 1) & ~(SIZE_CLASS - 1);
+    auto const sizeClass = rounded / SIZE_CLASS;
+    if (sizeClass < freeLists.size() && freeLists[sizeClass] != nullptr) {
+        // the first word of a free node is the pointer to the next free one
+        void *node = freeLists[sizeClass];
+        freeLists[sizeClass] = *static_cast<void **>(node);
+        usedBytes += rounded;
+        return node;
+    }
+
+    auto const numaNode = config.numaPolicy == NumaPolicy::SubtreeBind ? currentNumaNode : uint16_t{0};
+    auto &arena = arenas[numaNode];
+    if (arena.current == nullptr || static_cast<std::size_t>(arena.end - arena.current) < rounded) {
+        auto chunk = mapChunk(numaNode);
+        chunks.push_back(chunk);
+        chunkRanges.emplace(reinterpret_cast<std::uintptr_t>(chunk.base), chunk.size);
+        chunksMapped.store(true, std::memory_order_release);
+        arena.current = chunk.base;
+        arena.end = chunk.base + chunk.size;
+    }
+
+    void *node = arena.current;
+    arena.current += rounded;
+    usedBytes += rounded;
+    return node;
+}
+
+bool NodeAllocator::ownsPointer(void *ptr) {
+    auto const address = reinterpret_cast<std::uintptr_t>(ptr);
+    // the last chunk that starts at or before the pointer, chunks of both sizes may exist if the config was changed
+    auto chunk = chunkRanges.upper_bound(address);
+    if (chunk == chunkRanges.begin()) {
+        return false;
+    }
+    chunk--;
+    return address < chunk->first + chunk->second;
+}
+
+void NodeAllocator::deallocate(void *ptr, std::size_t size) {
+    if (ptr == nullptr) {
+        return;
+    }
+
+    // the thread that freed the node got it (directly or not) from the allocating one, so it also sees the flag
+    if (!chunksMapped.load(std::memory_order_acquire)) {
+        ::operator delete(ptr);
+        return;
+    }
+
+    std::unique_lock lock{mutex};
+    if (!ownsPointer(ptr)) {
+        lock.unlock();
+        ::operator delete(ptr);
+        return;
+    }
+
+    auto const rounded = (size + SIZE_CLASS - 1) & ~(SIZE_CLASS - 1);
+    auto const sizeClass = rounded / SIZE_CLASS;
+    if (sizeClass >= freeLists.size()) {
+        freeLists.resize(sizeClass + 1, nullptr);
+    }
+    *static_cast<void **>(ptr) = freeLists[sizeClass];
+    freeLists[sizeClass] = ptr;
+    usedBytes -= rounded;
+}
+
+std::size_t NodeAllocator::bytesInUse() {
+    std::lock_guard lock{mutex};
+    return usedBytes;
+}
+
+std::string NodeAllocator::placementReport() {
+    std::lock_guard lock{mutex};
+
+    std::stringstream out;
+    std::size_t mappedBytes = 0;
+    std::size_t hugeTlbChunks = 0;
+    // numa node -> number of sampled pages, negative keys are errors from move_pages (e.g. -ENOENT = not touched yet)
+    std::map<int, std::size_t> pagesPerNode;
+    std::map<uint16_t, std::size_t> chunksPerTarget;
+
+    for (auto const &chunk: chunks) {
+        mappedBytes += chunk.size;
+        hugeTlbChunks += chunk.hugeTlb;
+        chunksPerTarget[chunk.numaNode]++;
+
+        // with hugetlb we look at every huge page, otherwise we sample one page per 2MB
+        std::size_t const step = chunk.hugeTlb ? chunk.size : std::size_t{1} << 21;
+        std::vector<void *> pages;
+        for (std::size_t offset = 0; offset < chunk.size; offset += step) {
+            pages.push_back(chunk.base + offset);
+        }
+        std::vector<int> status(pages.size(), 0);
+        if (syscall(SYS_move_pages, 0, pages.size(), pages.data(), nullptr, status.data(), 0) != 0) {
+            std::ranges::fill(status, -1);
+        }
+        for (auto node: status) {
+            pagesPerNode[node]++;
+        }
+    }
+
+    out << "node arena: " << chunks.size() << " chunks, " << (mappedBytes >> 20) << " MB mapped, "
+        << (usedBytes >> 20) << " MB in use, " << hugeTlbChunks << " chunks backed by hugetlb pages\n";
+    out << "numa nodes online: " << numberOfNumaNodes() << '\n';
+    for (auto const &[target, count]: chunksPerTarget) {
+        out << "  chunks allocated for node " << target << ": " << count << '\n';
+    }
+    for (auto const &[node, count]: pagesPerNode) {
+        if (node >= 0) {
+            out << "  sampled pages on node " << node << ": " << count << '\n';
+        } else {
+            out << "  sampled pages not resident or unknown (" << node << "): " << count << '\n';
+        }
+    }
+    return out.str();
+}
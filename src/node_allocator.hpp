@@ -0,0 +1,104 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/** Backing pages for the node arena. Huge pages fall back to transparent huge pages if none are reserved. */
+enum class PageSize : uint8_t {
+    Default = 0, Huge2MB = 1, Huge1GB = 2
+};
+
+/** How arena chunks are placed on the NUMA nodes of the machine. */
+enum class NumaPolicy : uint8_t {
+    // pages land on the node of the thread that touches them first (kernel default)
+    FirstTouch = 0,
+    // pages of every chunk are spread round robin over all nodes
+    Interleave = 1,
+    // each top-level subtree (first key byte) is bound to one node, the byte range is split evenly
+    SubtreeBind = 2
+};
+
+struct NodeAllocatorConfig {
+    // if false, nodes are allocated with plain operator new
+    bool useArena = false;
+    PageSize pageSize = PageSize::Huge2MB;
+    NumaPolicy numaPolicy = NumaPolicy::FirstTouch;
+};
+
+/**
+ * Allocation backend for all tree nodes and leaves (see Node::operator new). When the arena is enabled, nodes are
+ * carved out of huge-page backed chunks with simple per size class free lists. An ordered map of the chunk ranges tells
+ * whether a pointer belongs to the arena, so nodes need no per-node header.
+ */
+class NodeAllocator {
+public:
+    static void configure(const NodeAllocatorConfig &config);
+
+    static NodeAllocatorConfig getConfig();
+
+    static void *allocate(std::size_t size);
+
+    static void deallocate(void *ptr, std::size_t size);
+
+    /** number of NUMA nodes that are online, at least 1 */
+    static uint16_t numberOfNumaNodes();
+
+    /** bytes currently handed out to nodes (arena mode only) */
+    static std::size_t bytesInUse();
+
+    /** human readable summary of the chunks and on which NUMA node their pages actually reside */
+    static std::string placementReport();
+
+    /** selects the NUMA node for allocations of the current thread when using NumaPolicy::SubtreeBind */
+    static void setSubtree(uint8_t firstKeyByte);
+
+private:
+    struct Chunk {
+        std::byte *base;
+        std::size_t size;
+        uint16_t numaNode;
+        bool hugeTlb;
+    };
+
+    struct Arena {
+        std::byte *current = nullptr;
+        std::byte *end = nullptr;
+    };
+
+    // allocation granularity, keeps all nodes 16 byte aligned
+    static constexpr std::size_t SIZE_CLASS = 16;
+    static constexpr std::size_t MAX_NUMA_NODES = 64;
+
+    static std::size_t chunkSize();
+
+    static Chunk mapChunk(uint16_t numaNode);
+
+    static bool ownsPointer(void *ptr);
+
+    // written and read under the mutex, only the two flags below are checked without it
+    static NodeAllocatorConfig config;
+    static std::mutex mutex;
+    // config.useArena, so allocations without the arena never take the mutex
+    static std::atomic<bool> arenaEnabled;
+    // set once the first chunk is mapped, until then no pointer can belong to the arena and frees skip the mutex
+    static std::atomic<bool> chunksMapped;
+    static std::vector<Chunk> chunks;
+    // base address -> size of every chunk
+    static std::map<std::uintptr_t, std::size_t> chunkRanges;
+    static std::array<Arena, MAX_NUMA_NODES> arenas;
+    static std::vector<void *> freeLists;
+    static std::size_t usedBytes;
+    static thread_local uint16_t currentNumaNode;
+};
+
+/** Sets the subtree of the key for all node allocations in the current scope. */
+class NodePlacementScope {
+public:
+    explicit NodePlacementScope(uint8_t firstKeyByte) { NodeAllocator::setSubtree(firstKeyByte); }
+};
@@ -0,0 +1,260 @@
+#include "profiler.hpp"
+
+#include "art.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <linux/perf_event.h>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+
+/** one hardware counter of the calling thread (user space only) */
+class PerfCounter {
+public:
+    bool open(uint32_t type, uint64_t config) {
+        perf_event_attr attributes{};
+        attributes.size = sizeof(attributes);
+        attributes.type = type;
+        attributes.config = config;
+        attributes.exclude_kernel = 1;
+        attributes.exclude_hv = 1;
+        // there is no glibc wrapper for it
+        fd = static_cast<int>(syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0));
+        if (fd < 0) {
+            return false;
+        }
+        // the first page tells whether rdpmc is allowed and which counter to read
+        auto *mapped = mmap(nullptr, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fd, 0);
+        page = mapped != MAP_FAILED ? static_cast<perf_event_mmap_page *>(mapped) : nullptr;
+        return true;
+    }
+
+    uint64_t read() const {
+        if (page != nullptr && page->cap_user_rdpmc) {
+            // seqlock protocol of perf_event_mmap_page, retried if the kernel updated the page in between
+            uint32_t sequence;
+            uint64_t count;
+            uint32_t index;
+            do {
+                sequence = page->lock;
+                std::atomic_signal_fence(std::memory_order_acquire);
+                index = page->index;
+                count = page->offset;
+                if (index != 0) {
+                    auto const width = page->pmc_width;
+                    auto pmc = static_cast<int64_t>(__builtin_ia32_rdpmc(static_cast<int>(index - 1)));
+                    // sign extend the counter from its width
+                    count += static_cast<uint64_t>((pmc << (64 - width)) >> (64 - width));
+                }
+                std::atomic_signal_fence(std::memory_order_acquire);
+            } while (page->lock != sequence);
+            if (index != 0) {
+                return count;
+            }
+        }
+        uint64_t count = 0;
+        return ::read(fd, &count, sizeof(count)) == sizeof(count) ? count : 0;
+    }
+
+    ~PerfCounter() {
+        if (page != nullptr) {
+            munmap(page, sysconf(_SC_PAGESIZE));
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+private:
+    int fd = -1;
+    perf_event_mmap_page *page = nullptr;
+};
+
+constexpr uint64_t cacheMiss(uint64_t cache) {
+    return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+}
+
+/** counters and the sample in flight of one thread, shared by all profilers */
+struct ThreadState {
+    ThreadState() {
+        available = llcMisses.open(PERF_TYPE_HW_CACHE, cacheMiss(PERF_COUNT_HW_CACHE_LL)) &&
+                    dtlbMisses.open(PERF_TYPE_HW_CACHE, cacheMiss(PERF_COUNT_HW_CACHE_DTLB)) &&
+                    branchMisses.open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+    }
+
+    Profiler::Counts read() const {
+        auto const nanoseconds = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count());
+        if (!available) {
+            return {nanoseconds, 0, 0, 0};
+        }
+        return {nanoseconds, llcMisses.read(), dtlbMisses.read(), branchMisses.read()};
+    }
+
+    PerfCounter llcMisses;
+    PerfCounter dtlbMisses;
+    PerfCounter branchMisses;
+    bool available;
+
+    uint64_t operations = 0;
+    Profiler::Sample sample;
+};
+
+ThreadState &threadState() {
+    static thread_local ThreadState state;
+    return state;
+}
+
+uint8_t kindOf(const Node *node) {
+    return node->isLeafNode ? 4 : static_cast<uint8_t>(node->type);
+}
+
+const char *kindName(std::size_t kind) {
+    static constexpr std::array<const char *, Profiler::NUMBER_OF_KINDS> names{"N4", "N16", "N48", "N256", "leaf"};
+    return names[kind];
+}
+
+const char *operationName(std::size_t operation) {
+    return operation == static_cast<std::size_t>(Profiler::Operation::Lookup) ? "lookup" : "insert";
+}
+
+}
+
+void Profiler::Sample::enter(const Node *node) {
+    auto const now = threadState().read();
+    if (levels > 0) {
+        for (std::size_t event = 0; event < NUMBER_OF_EVENTS; event++) {
+            costs[levels - 1][event] += now[event] - last[event];
+        }
+    }
+    if (levels < MAX_LEVELS) {
+        kinds[levels++] = kindOf(node);
+    }
+    last = now;
+}
+
+Profiler::Profiler(uint32_t sampleEvery) : sampleEvery(std::max(sampleEvery, 1u)) {}
+
+std::unique_ptr<Profiler> Profiler::fromEnvironment() {
+    auto const *configured = std::getenv("ART_PROFILE");
+    if (configured == nullptr) {
+        return nullptr;
+    }
+    auto const sampleEvery = std::atoi(configured);
+    auto profiler = std::make_unique<Profiler>(sampleEvery > 0 ? sampleEvery : 1000);
+    profiler->printReport = true;
+    if (auto const *prefix = std::getenv("ART_PROFILE_FOLDED")) {
+        profiler->foldedPrefix = prefix;
+    }
+    return profiler;
+}
+
+Profiler::Sample *Profiler::begin(Operation operation) {
+    auto &state = threadState();
+    if (++state.operations % sampleEvery != 0) {
+        return nullptr;
+    }
+    state.sample = Sample{};
+    state.sample.operation = operation;
+    state.sample.last = state.read();
+    return &state.sample;
+}
+
+void Profiler::end(Sample *sample) {
+    auto const now = threadState().read();
+    std::lock_guard lock{mutex};
+    samples++;
+    if (sample->levels == 0) {
+        // empty tree
+        return;
+    }
+    for (std::size_t event = 0; event < NUMBER_OF_EVENTS; event++) {
+        sample->costs[sample->levels - 1][event] += now[event] - sample->last[event];
+    }
+
+    std::string stack = operationName(static_cast<std::size_t>(sample->operation));
+    for (uint8_t level = 0; level < sample->levels; level++) {
+        auto &cell = cells[static_cast<std::size_t>(sample->operation)][level][sample->kinds[level]];
+        cell.visits++;
+        stack += ";L" + std::to_string(level) + " " + kindName(sample->kinds[level]);
+        auto &frame = stacks[stack];
+        for (std::size_t event = 0; event < NUMBER_OF_EVENTS; event++) {
+            cell.totals[event] += sample->costs[level][event];
+            frame[event] += sample->costs[level][event];
+        }
+    }
+}
+
+bool Profiler::hardwareCountersAvailable() {
+    return threadState().available;
+}
+
+const char *Profiler::eventName(Event event) {
+    static constexpr std::array<const char *, NUMBER_OF_EVENTS> names{"ns", "llc-misses", "dtlb-misses",
+                                                                      "branch-misses"};
+    return names[static_cast<std::size_t>(event)];
+}
+
+std::string Profiler::report() const {
+    std::lock_guard lock{mutex};
+    std::ostringstream out;
+    auto const hardware = hardwareCountersAvailable();
+    out << "ART profile: " << samples << " sampled operations (every " << sampleEvery << "th), hardware counters "
+        << (hardware ? "on" : "not available, only time") << '\n';
+    out << std::setw(8) << "op" << std::setw(7) << "level" << std::setw(6) << "node" << std::setw(10) << "visits";
+    for (std::size_t event = 0; event < NUMBER_OF_EVENTS; event++) {
+        out << std::setw(20) << eventName(static_cast<Event>(event)) + std::string("/visit");
+    }
+    out << '\n';
+
+    for (std::size_t operation = 0; operation < cells.size(); operation++) {
+        for (std::size_t level = 0; level < MAX_LEVELS; level++) {
+            for (std::size_t kind = 0; kind < NUMBER_OF_KINDS; kind++) {
+                auto const &cell = cells[operation][level][kind];
+                if (cell.visits == 0) {
+                    continue;
+                }
+                out << std::setw(8) << operationName(operation) << std::setw(7) << level << std::setw(6)
+                    << kindName(kind) << std::setw(10) << cell.visits << std::fixed << std::setprecision(2);
+                for (std::size_t event = 0; event < NUMBER_OF_EVENTS; event++) {
+                    if (event > 0 && !hardware) {
+                        out << std::setw(20) << "-";
+                    } else {
+                        out << std::setw(20) << static_cast<double>(cell.totals[event]) / cell.visits;
+                    }
+                }
+                out << '\n';
+            }
+        }
+    }
+    return out.str();
+}
+
+void Profiler::writeFolded(std::ostream &out, Event event) const {
+    std::lock_guard lock{mutex};
+    for (auto const &[stack, totals]: stacks) {
+        if (auto const total = totals[static_cast<std::size_t>(event)]; total > 0) {
+            out << stack << ' ' << total << '\n';
+        }
+    }
+}
+
+void Profiler::writeConfiguredOutput() const {
+    if (printReport) {
+        std::cerr << report();
+    }
+    if (foldedPrefix.empty()) {
+        return;
+    }
+    for (std::size_t event = 0; event < NUMBER_OF_EVENTS; event++) {
+        std::ofstream file{foldedPrefix + "." + eventName(static_cast<Event>(event)) + ".folded"};
+        writeFolded(file, static_cast<Event>(event));
+    }
+}
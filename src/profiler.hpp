@@ -0,0 +1,103 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+
+class Node;
+
+/**
+ * Sampling profiler for ART::lookup and ART::insert. Every `sampleEvery`-th operation of a thread is sampled: at every
+ * node it visits, the profiler reads the time and the hardware counters (LLC misses, dTLB misses, branch misses) and
+ * charges the difference to the previous node, i.e. to its level in the tree and its type. For an insert, the work after
+ * the descent (new leaf, new or grown node) goes to the last node it visited.
+ *
+ * The counters are opened per thread through perf_event_open and read with rdpmc where the kernel allows it (a few ns),
+ * with read() otherwise. If perf_event_open is not available (no PMU, perf_event_paranoid, seccomp), only time is
+ * reported.
+ *
+ * Setting ART_PROFILE=<sampleEvery> in the environment enables it for every ART of the process, which prints its
+ * report to stderr when it is destroyed. ART_PROFILE_FOLDED=<prefix> also writes <prefix>.<event>.folded for each event,
+ * the folded stack format of flamegraph.pl.
+ */
+class Profiler {
+public:
+    enum class Operation : uint8_t {
+        Lookup = 0, Insert = 1
+    };
+
+    enum class Event : uint8_t {
+        Nanoseconds = 0, LlcMisses = 1, DtlbMisses = 2, BranchMisses = 3
+    };
+
+    static constexpr std::size_t NUMBER_OF_EVENTS = 4;
+    // root plus one inner node per key byte plus the leaf
+    static constexpr std::size_t MAX_LEVELS = 10;
+    // NodeType::N4..N256 and leaves
+    static constexpr std::size_t NUMBER_OF_KINDS = 5;
+
+    using Counts = std::array<uint64_t, NUMBER_OF_EVENTS>;
+
+    /** one sampled operation of the calling thread */
+    class Sample {
+    public:
+        /** charges everything since the last call to the previous node and continues with `node` */
+        void enter(const Node *node);
+
+    private:
+        friend class Profiler;
+
+        Operation operation;
+        uint8_t levels = 0;
+        std::array<uint8_t, MAX_LEVELS> kinds{};
+        std::array<Counts, MAX_LEVELS> costs{};
+        Counts last{};
+    };
+
+    explicit Profiler(uint32_t sampleEvery);
+
+    /** a profiler as configured by ART_PROFILE / ART_PROFILE_FOLDED, nullptr if it is not set */
+    static std::unique_ptr<Profiler> fromEnvironment();
+
+    /** the sample to pass through the operation, nullptr if this one is not sampled */
+    Sample *begin(Operation operation);
+
+    /** adds a sample returned by begin() to the totals */
+    void end(Sample *sample);
+
+    /** true if the hardware counters could be opened on the calling thread */
+    static bool hardwareCountersAvailable();
+
+    /** table of visits and average costs per operation, level and node type */
+    std::string report() const;
+
+    /** folded stacks ("lookup;L0 N256;L1 N4;L2 leaf <total>") weighted by `event` */
+    void writeFolded(std::ostream &out, Event event) const;
+
+    /** prints the report and writes the folded files if configured through the environment */
+    void writeConfiguredOutput() const;
+
+    static const char *eventName(Event event);
+
+private:
+    struct Cell {
+        uint64_t visits = 0;
+        Counts totals{};
+    };
+
+    uint32_t sampleEvery;
+    // set by fromEnvironment() only
+    bool printReport = false;
+    std::string foldedPrefix;
+
+    mutable std::mutex mutex;
+    uint64_t samples = 0;
+    std::array<std::array<std::array<Cell, NUMBER_OF_KINDS>, MAX_LEVELS>, 2> cells{};
+    std::map<std::string, Counts> stacks;
+};
@@ -0,0 +1,412 @@
+#include "wal.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <fcntl.h>
+#include <filesystem>
+#include <stdexcept>
+#include <system_error>
+#include <unistd.h>
+#include "immintrin.h"
+
+namespace {
+    constexpr std::array<char, 8> CHECKPOINT_MAGIC = {'A', 'R', 'T', 'C', 'K', 'P', 'T', '2'};
+    constexpr const char *CHECKPOINT_FILE = "checkpoint.art";
+    constexpr const char *CHECKPOINT_TMP_FILE = "checkpoint.art.tmp";
+
+    uint32_t crc32c(const uint8_t *data, std::size_t length, uint32_t crc = 0) {
+        crc = ~crc;
+        for (std::size_t i = 0; i < length; i++) {
+            crc = _mm_crc32_u8(crc, data[i]);
+        }
+        return ~crc;
+    }
+
+    void writeAll(int fd, const uint8_t *data, std::size_t length) {
+        while (length > 0) {
+            auto written = ::write(fd, data, length);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::system_error(errno, std::generic_category(), "write-ahead log write failed");
+            }
+            data += written;
+            length -= written;
+        }
+    }
+
+    /** reads a file front to back through a fixed buffer, recovery never has a whole log or checkpoint in memory */
+    class FileReader {
+    public:
+        explicit FileReader(const std::string &path) : fd(::open(path.c_str(), O_RDONLY)), path(path) {}
+
+        ~FileReader() {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+        }
+
+        FileReader(const FileReader &) = delete;
+
+        FileReader &operator=(const FileReader &) = delete;
+
+        bool isOpen() const { return fd >= 0; }
+
+        /** true if all bytes of the file have been read */
+        bool atEnd() {
+            return begin == end && !refill();
+        }
+
+        /** copies the next `length` bytes to `out`, returns false if the file ends before */
+        bool read(void *out, std::size_t length) {
+            auto *bytes = static_cast<uint8_t *>(out);
+            while (length > 0) {
+                if (begin == end && !refill()) {
+                    return false;
+                }
+                auto const chunk = std::min(length, end - begin);
+                std::memcpy(bytes, buffer.data() + begin, chunk);
+                begin += chunk;
+                bytes += chunk;
+                length -= chunk;
+            }
+            return true;
+        }
+
+    private:
+        bool refill() {
+            ssize_t bytes;
+            do {
+                bytes = ::read(fd, buffer.data(), buffer.size());
+            } while (bytes < 0 && errno == EINTR);
+            if (bytes < 0) {
+                throw std::system_error(errno, std::generic_category(), "cannot read " + path);
+            }
+            begin = 0;
+            end = static_cast<std::size_t>(bytes);
+            return bytes > 0;
+        }
+
+        int fd;
+        std::string path;
+        std::array<uint8_t, 1 << 16> buffer{};
+        std::size_t begin = 0;
+        std::size_t end = 0;
+    };
+
+    void syncDirectory(const std::string &directory) {
+        int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+        if (fd >= 0) {
+            ::fsync(fd);
+            ::close(fd);
+        }
+    }
+
+    void appendKeyValue(std::vector<uint8_t> &out, const Key &key, Value value) {
+        out.push_back(key.key_len);
+        out.insert(out.end(), key.key.begin(), key.key.begin() + key.key_len);
+        auto const *valueBytes = reinterpret_cast<const uint8_t *>(&value);
+        out.insert(out.end(), valueBytes, valueBytes + sizeof(Value));
+    }
+}
+
+WriteAheadLog::WriteAheadLog(std::string directory, uint64_t firstSegment, WalConfig config)
+        : directory(std::move(directory)), config(config) {
+    std::filesystem::create_directories(this->directory);
+    openSegment(firstSegment);
+    flushThread = std::thread([this] { flushLoop(); });
+}
+
+WriteAheadLog::~WriteAheadLog() {
+    {
+        std::lock_guard lock{mutex};
+        stop = true;
+    }
+    flushNeeded.notify_one();
+    flushThread.join();
+    ::close(fd);
+}
+
+std::string WriteAheadLog::segmentPath(const std::string &directory, uint64_t segment) {
+    std::array<char, 32> name{};
+    std::snprintf(name.data(), name.size(), "wal.%08lu.log", static_cast<unsigned long>(segment));
+    return (std::filesystem::path(directory) / name.data()).string();
+}
+
+std::vector<uint64_t> WriteAheadLog::listSegments(const std::string &directory) {
+    std::vector<uint64_t> segments;
+    std::error_code error;
+    for (auto const &entry: std::filesystem::directory_iterator(directory, error)) {
+        auto name = entry.path().filename().string();
+        unsigned long segment;
+        if (name.starts_with("wal.") && name.ends_with(".log") && std::sscanf(name.c_str(), "wal.%lu.log", &segment) == 1) {
+            segments.push_back(segment);
+        }
+    }
+    std::ranges::sort(segments);
+    return segments;
+}
+
+void WriteAheadLog::openSegment(uint64_t segment) {
+    auto path = segmentPath(directory, segment);
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "cannot open write-ahead log segment " + path);
+    }
+    currentSegment = segment;
+    // make the new file itself durable
+    syncDirectory(directory);
+}
+
+bool WriteAheadLog::appendInsert(const Key &key, Value value) {
+    std::array<uint8_t, 2 + 8 + sizeof(Value) + sizeof(uint32_t)> record{};
+    std::size_t length = 0;
+    record[length++] = static_cast<uint8_t>(WalRecordType::Insert);
+    record[length++] = key.key_len;
+    std::memcpy(record.data() + length, key.key.data(), key.key_len);
+    length += key.key_len;
+    std::memcpy(record.data() + length, &value, sizeof(Value));
+    length += sizeof(Value);
+    auto crc = crc32c(record.data(), length);
+    std::memcpy(record.data() + length, &crc, sizeof(crc));
+    length += sizeof(crc);
+
+    bool wakeUp;
+    bool checkpointDue;
+    {
+        std::lock_guard lock{mutex};
+        throwIfFailed();
+        pending.insert(pending.end(), record.begin(), record.begin() + length);
+        appendedBytes += length;
+        wakeUp = pending.size() >= config.groupCommitBytes;
+        checkpointDue = config.checkpointBytes != 0 && appendedBytes - segmentStartBytes >= config.checkpointBytes;
+    }
+    if (wakeUp) {
+        flushNeeded.notify_one();
+    }
+    return checkpointDue;
+}
+
+void WriteAheadLog::flushLoop() {
+    std::vector<uint8_t> batch;
+    std::unique_lock lock{mutex};
+    while (true) {
+        flushNeeded.wait_for(lock, config.flushInterval, [this] {
+            return stop || pending.size() >= config.groupCommitBytes;
+        });
+        if (pending.empty()) {
+            if (stop) {
+                return;
+            }
+            continue;
+        }
+
+        // swap the buffers, appends can go on while we write and fsync
+        batch.clear();
+        std::swap(batch, pending);
+        auto const batchEnd = appendedBytes;
+        lock.unlock();
+        std::exception_ptr failure;
+        try {
+            std::lock_guard ioLock{ioMutex};
+            writeAll(fd, batch.data(), batch.size());
+            if (::fdatasync(fd) != 0) {
+                throw std::system_error(errno, std::generic_category(), "write-ahead log sync failed");
+            }
+        } catch (const std::system_error &) {
+            failure = std::current_exception();
+        }
+        lock.lock();
+        if (failure) {
+            // after a failed fdatasync the kernel may have dropped the dirty pages, retrying would report lost
+            // records as durable -> give up, every waiter and every further append gets the error
+            error = failure;
+            pending.clear();
+            flushed.notify_all();
+            flushNeeded.wait(lock, [this] { return stop; });
+            return;
+        }
+        durableBytes = batchEnd;
+        flushed.notify_all();
+    }
+}
+
+void WriteAheadLog::throwIfFailed() const {
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+void WriteAheadLog::sync() {
+    std::unique_lock lock{mutex};
+    auto const target = appendedBytes;
+    if (durableBytes >= target) {
+        return;
+    }
+    throwIfFailed();
+    flushNeeded.notify_one();
+    flushed.wait(lock, [this, target] { return durableBytes >= target || error; });
+    throwIfFailed();
+}
+
+uint64_t WriteAheadLog::rotate() {
+    sync();
+    std::lock_guard ioLock{ioMutex};
+    ::close(fd);
+    openSegment(currentSegment + 1);
+    std::lock_guard lock{mutex};
+    // records appended since the sync above are still pending, they go to the new segment
+    segmentStartBytes = durableBytes;
+    return currentSegment;
+}
+
+void WriteAheadLog::removeSegmentsBefore(uint64_t segment) {
+    for (auto existing: listSegments(directory)) {
+        if (existing < segment) {
+            std::filesystem::remove(segmentPath(directory, existing));
+        }
+    }
+}
+
+bool WriteAheadLog::replaySegment(const std::string &directory, uint64_t segment, const EntryVisitor &apply) {
+    FileReader reader{segmentPath(directory, segment)};
+    if (!reader.isOpen()) {
+        return true;
+    }
+    std::array<uint8_t, 2 + 8 + sizeof(Value) + sizeof(uint32_t)> record{};
+    while (!reader.atEnd()) {
+        // type and key length tell how long the rest of the record is
+        if (!reader.read(record.data(), 2)) {
+            return false;
+        }
+        auto const type = record[0];
+        auto const keyLength = record[1];
+        auto const length = 2 + keyLength + sizeof(Value);
+        if (type != static_cast<uint8_t>(WalRecordType::Insert) || keyLength > 8 ||
+            !reader.read(record.data() + 2, length - 2 + sizeof(uint32_t))) {
+            return false;
+        }
+        uint32_t crc;
+        std::memcpy(&crc, record.data() + length, sizeof(crc));
+        if (crc != crc32c(record.data(), length)) {
+            return false;
+        }
+
+        Key key{reinterpret_cast<const char *>(record.data() + 2), keyLength};
+        Value value;
+        std::memcpy(&value, record.data() + 2 + keyLength, sizeof(Value));
+        apply(key, value);
+    }
+    return true;
+}
+
+void WriteAheadLog::writeCheckpoint(const std::string &directory, uint64_t segment,
+                                    const std::function<void(const EntryVisitor &)> &forEachEntry) {
+    // layout: magic, first segment to replay, entries (key length, key, value), number of entries, crc32c of
+    // everything. The count comes last, so the entries can go to the file while the tree is walked.
+
+    // write to a temporary file first, so a crash during the checkpoint leaves the old one intact
+    auto tmpPath = (std::filesystem::path(directory) / CHECKPOINT_TMP_FILE).string();
+    int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "cannot create checkpoint " + tmpPath);
+    }
+
+    constexpr std::size_t bufferSize = 1 << 16;
+    std::vector<uint8_t> buffer;
+    buffer.reserve(bufferSize + 1 + 8 + sizeof(Value));
+    uint32_t crc = 0;
+    auto flush = [&] {
+        crc = crc32c(buffer.data(), buffer.size(), crc);
+        writeAll(fd, buffer.data(), buffer.size());
+        buffer.clear();
+    };
+    auto appendBytes = [&](const void *data, std::size_t length) {
+        auto const *bytes = static_cast<const uint8_t *>(data);
+        buffer.insert(buffer.end(), bytes, bytes + length);
+    };
+
+    try {
+        appendBytes(CHECKPOINT_MAGIC.data(), CHECKPOINT_MAGIC.size());
+        appendBytes(&segment, sizeof(segment));
+        uint64_t count = 0;
+        forEachEntry([&](const Key &key, Value value) {
+            appendKeyValue(buffer, key, value);
+            count++;
+            if (buffer.size() >= bufferSize) {
+                flush();
+            }
+        });
+        appendBytes(&count, sizeof(count));
+        flush();
+        writeAll(fd, reinterpret_cast<const uint8_t *>(&crc), sizeof(crc));
+        if (::fsync(fd) != 0) {
+            throw std::system_error(errno, std::generic_category(), "cannot sync checkpoint " + tmpPath);
+        }
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+    ::close(fd);
+    std::filesystem::rename(tmpPath, std::filesystem::path(directory) / CHECKPOINT_FILE);
+    syncDirectory(directory);
+}
+
+uint64_t WriteAheadLog::readCheckpoint(const std::string &directory, const EntryVisitor &apply) {
+    auto const path = (std::filesystem::path(directory) / CHECKPOINT_FILE).string();
+    auto corrupt = [&] { return std::runtime_error("checkpoint in " + directory + " is corrupt"); };
+    std::error_code error;
+    auto const fileSize = std::filesystem::file_size(path, error);
+    if (error || fileSize == 0) {
+        return 0;
+    }
+    auto const headerSize = CHECKPOINT_MAGIC.size() + sizeof(uint64_t);
+    if (fileSize < headerSize + sizeof(uint64_t) + sizeof(uint32_t)) {
+        throw corrupt();
+    }
+
+    // first pass: checksum and the count at the end. The rename is atomic, so a mismatch is not a torn write but real
+    // corruption.
+    uint64_t count;
+    {
+        FileReader reader{path};
+        std::array<uint8_t, 1 << 16> chunk{};
+        uint32_t crc = 0;
+        auto remaining = fileSize - sizeof(count) - sizeof(uint32_t);
+        while (remaining > 0) {
+            auto const length = std::min<std::size_t>(remaining, chunk.size());
+            if (!reader.read(chunk.data(), length)) {
+                throw corrupt();
+            }
+            crc = crc32c(chunk.data(), length, crc);
+            remaining -= length;
+        }
+        uint32_t storedCrc;
+        if (!reader.read(&count, sizeof(count)) || !reader.read(&storedCrc, sizeof(storedCrc))) {
+            throw corrupt();
+        }
+        if (storedCrc != crc32c(reinterpret_cast<const uint8_t *>(&count), sizeof(count), crc)) {
+            throw corrupt();
+        }
+    }
+
+    FileReader reader{path};
+    std::array<char, CHECKPOINT_MAGIC.size()> magic{};
+    uint64_t segment;
+    if (!reader.read(magic.data(), magic.size()) || magic != CHECKPOINT_MAGIC || !reader.read(&segment, sizeof(segment))) {
+        throw corrupt();
+    }
+    std::array<uint8_t, 8 + sizeof(Value)> entry{};
+    for (uint64_t i = 0; i < count; i++) {
+        uint8_t keyLength;
+        if (!reader.read(&keyLength, 1) || keyLength > 8 || !reader.read(entry.data(), keyLength + sizeof(Value))) {
+            throw corrupt();
+        }
+        Key key{reinterpret_cast<const char *>(entry.data()), keyLength};
+        Value value;
+        std::memcpy(&value, entry.data() + keyLength, sizeof(Value));
+        apply(key, value);
+    }
+    return segment;
+}
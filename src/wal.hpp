@@ -0,0 +1,125 @@
+#pragma once
+
+#include "key.hpp"
+#include "key_utils.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/** Record types in the log. Only inserts exist for now, update/delete get their own type once the tree supports them. */
+enum class WalRecordType : uint8_t {
+    Insert = 1
+};
+
+struct WalConfig {
+    // the flush thread writes and fsyncs at least this often if there is anything pending
+    std::chrono::microseconds flushInterval{1000};
+    // wake up the flush thread early once this many bytes are pending
+    std::size_t groupCommitBytes = 1 << 20;
+    // the tree writes a checkpoint once the current segment has grown by this many bytes, 0 = only ART::checkpoint()
+    std::size_t checkpointBytes = std::size_t{64} << 20;
+};
+
+/**
+ * Write-ahead log for the mutations of one ART. Appends only copy the record into an in-memory buffer, a background
+ * thread writes the buffer out and fsyncs it (group commit). The log is split into numbered segments
+ * (wal.<n>.log), a checkpoint covers everything before a segment number, so older segments can be dropped.
+ *
+ * Record layout: type (1 byte), key length (1 byte), key bytes, value (8 bytes), crc32c of the previous fields (4 bytes).
+ * A torn record at the end of the log fails its checksum and marks the end of the replay.
+ *
+ * A failed write or fdatasync of the flush thread is sticky: nothing is reported durable from then on, and sync(),
+ * rotate() and every further append throw the std::system_error of the failure.
+ */
+class WriteAheadLog {
+public:
+    /** opens a new segment `firstSegment` in `directory`, which is created if it does not exist */
+    WriteAheadLog(std::string directory, uint64_t firstSegment, WalConfig config = {});
+
+    ~WriteAheadLog();
+
+    WriteAheadLog(const WriteAheadLog &) = delete;
+
+    WriteAheadLog &operator=(const WriteAheadLog &) = delete;
+
+    /**
+     * Throws if the log failed before. Returns true once the current segment holds WalConfig::checkpointBytes or more,
+     * i.e. it is time for a checkpoint.
+     */
+    bool appendInsert(const Key &key, Value value);
+
+    /** blocks until everything appended so far is durable, throws if the log failed before that */
+    void sync();
+
+    /** syncs and starts a new segment. Returns its number, all earlier records are in smaller segments. */
+    uint64_t rotate();
+
+    /** deletes all segments before `segment`, call this only once a checkpoint covers them */
+    void removeSegmentsBefore(uint64_t segment);
+
+    const std::string &getDirectory() const { return directory; }
+
+    /** numbers of all segments in `directory`, sorted ascending */
+    static std::vector<uint64_t> listSegments(const std::string &directory);
+
+    static std::string segmentPath(const std::string &directory, uint64_t segment);
+
+    /**
+     * Calls `apply` for every valid insert record of `segment`. Returns false if the segment ended in a torn or
+     * corrupt record, i.e. nothing after it can be trusted. The segment is read in small pieces, not all at once.
+     */
+    static bool replaySegment(const std::string &directory, uint64_t segment, const EntryVisitor &apply);
+
+    /**
+     * Atomically replaces the checkpoint in `directory` with all entries produced by `forEachEntry`. Replay after this
+     * checkpoint starts at `segment`. The entries are streamed to the file, they are never all in memory at once.
+     */
+    static void writeCheckpoint(const std::string &directory, uint64_t segment,
+                                const std::function<void(const EntryVisitor &)> &forEachEntry);
+
+    /**
+     * Calls `apply` for every entry of the checkpoint, returns the first segment to replay (0 if there is none).
+     * Reads the file twice in small pieces: once to verify the checksum, so nothing of a corrupt checkpoint is applied,
+     * and once for the entries.
+     */
+    static uint64_t readCheckpoint(const std::string &directory, const EntryVisitor &apply);
+
+private:
+    void openSegment(uint64_t segment);
+
+    void flushLoop();
+
+    /** rethrows the failure of the flush thread, if any. Needs `mutex`. */
+    void throwIfFailed() const;
+
+    std::string directory;
+    WalConfig config;
+
+    // protects pending, the sequence numbers, error and stop
+    std::mutex mutex;
+    std::condition_variable flushNeeded;
+    std::condition_variable flushed;
+    std::vector<uint8_t> pending;
+    // bytes appended / bytes durable since the log was opened
+    uint64_t appendedBytes = 0;
+    uint64_t durableBytes = 0;
+    // appendedBytes when the current segment was started
+    uint64_t segmentStartBytes = 0;
+    // first write or sync failure of the flush thread, nothing becomes durable after it
+    std::exception_ptr error;
+    bool stop = false;
+
+    // protects fd and currentSegment, held by the flush thread while writing
+    std::mutex ioMutex;
+    int fd = -1;
+    uint64_t currentSegment = 0;
+
+    std::thread flushThread;
+};
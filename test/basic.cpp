@@ -1,11 +1,16 @@
 #include "gtest/gtest.h"
 
 #include "art.hpp"
+#include "compact_art.hpp"
+#include "key_encoding.hpp"
 
 #include <iostream>
 #include <array>
 #include <random>
 #include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <unistd.h>
 
 // This is a small helper test to help you understand the layout of our Key struct.
 TEST(ART, BasicKeys) {
@@ -65,6 +70,24 @@ TEST(Node4, InsertNode) {
     ASSERT_EQ(reinterpret_cast<Value>(node.children[0]), 1);
 }
 
+TEST(Node4, FindChildIgnoresUnusedKeys) {
+    // unused key bytes are zero (or stale after a removal), they must not match
+    auto node = Node4();
+    auto child = reinterpret_cast<Node *>(Value{1});
+    EXPECT_EQ(node.findChild(0), nullptr);
+    node.addChildren(5, child);
+    EXPECT_EQ(node.findChild(0), nullptr);
+    EXPECT_EQ(node.getChildren(5), child);
+    node.addChildren(0, reinterpret_cast<Node *>(Value{2}));
+    EXPECT_EQ(node.getChildren(0), reinterpret_cast<Node *>(Value{2}));
+
+    node.removeChildren(5);
+    node.removeChildren(0);
+    EXPECT_EQ(node.numberOfChildren, 0);
+    EXPECT_EQ(node.findChild(0), nullptr);
+    EXPECT_EQ(node.findChild(5), nullptr);
+}
+
 //GROW TESTS
 TEST(Node, grow) {
     auto node4 = Node4();
@@ -361,7 +384,7 @@ TEST(ART, SpecialPatterns) {
 
 TEST(ART, ManyInsertionsReverse) {
     ART index{};
-    std::array<uint64_t, 100000> keys{};
+    std::array<uint64_t, 100001> keys{};
 
     for (uint64_t i = 100000; i > 0; i--) {
         keys[i] = i + 1;
@@ -396,7 +419,8 @@ TEST(ART, StringKeysPatterns) {
 
 TEST(ART, ManyInsertions5) {
     ART index{};
-    std::array<uint64_t, 1000000> keys{};
+    // 8MB would not fit on the default stack
+    static std::array<uint64_t, 1000000> keys{};
 
     for (uint64_t i = 0; i < 1000000; i++) {
         keys[i] = i + 1;
@@ -472,6 +496,694 @@ TEST(ART, StringKeys) {
     EXPECT_EQ(index.lookup(Key{"foo3", key_len}), 4);
 }
 
+TEST(ART, NodeArena) {
+    NodeAllocator::configure({.useArena = true, .pageSize = PageSize::Huge2MB, .numaPolicy = NumaPolicy::SubtreeBind});
+    {
+        ART index{};
+        for (uint64_t i = 1; i <= 10000; i++) {
+            ASSERT_TRUE(index.insert(Key{i * 7919}, i));
+        }
+        for (uint64_t i = 1; i <= 10000; i++) {
+            EXPECT_EQ(index.lookup(Key{i * 7919}), i);
+        }
+        EXPECT_GT(NodeAllocator::bytesInUse(), 10000 * sizeof(LeafNode));
+
+        auto report = NodeAllocator::placementReport();
+        EXPECT_NE(report.find("node arena"), std::string::npos);
+
+        // blocks larger than a chunk come from operator new and must not end up on the free lists
+        auto const inUse = NodeAllocator::bytesInUse();
+        auto *block = NodeAllocator::allocate(std::size_t{3} << 20);
+        NodeAllocator::deallocate(block, std::size_t{3} << 20);
+        EXPECT_EQ(NodeAllocator::bytesInUse(), inUse);
+    }
+    NodeAllocator::configure({});
+
+    // nodes from the arena are still freed correctly after switching back
+    auto *leaf = new LeafNode(Key{1}, 1);
+    delete leaf;
+}
+
+TEST(ART, WalRecovery) {
+    auto directory = std::filesystem::temp_directory_path() / ("art_wal_test_" + std::to_string(getpid()));
+    std::filesystem::remove_all(directory);
+
+    {
+        ART index{};
+        ASSERT_TRUE(index.recover(directory));
+        for (uint64_t i = 1; i <= 1000; i++) {
+            ASSERT_TRUE(index.insert(Key{i}, i));
+        }
+        index.checkpoint();
+        for (uint64_t i = 1001; i <= 2000; i++) {
+            ASSERT_TRUE(index.insert(Key{i}, i));
+        }
+        index.sync();
+    }
+
+    // simulate a crash in the middle of writing a record
+    auto segments = WriteAheadLog::listSegments(directory);
+    ASSERT_FALSE(segments.empty());
+    {
+        std::ofstream torn{WriteAheadLog::segmentPath(directory, segments.back()), std::ios::app | std::ios::binary};
+        torn << '\x01' << '\x08' << "abc";
+    }
+
+    {
+        ART index{};
+        ASSERT_TRUE(index.recover(directory));
+        for (uint64_t i = 1; i <= 2000; i++) {
+            EXPECT_EQ(index.lookup(Key{i}), i);
+        }
+        ASSERT_TRUE(index.insert(Key{2001}, 2001));
+        index.sync();
+    }
+
+    ART index{};
+    ASSERT_TRUE(index.recover(directory));
+    EXPECT_EQ(index.lookup(Key{2001}), 2001);
+    EXPECT_EQ(index.lookup(Key{1}), 1);
+    EXPECT_FALSE(index.recover(directory));
+
+    std::filesystem::remove_all(directory);
+}
+
+TEST(ART, WalCheckpointTrigger) {
+    auto directory = std::filesystem::temp_directory_path() / ("art_wal_trigger_" + std::to_string(getpid()));
+    std::filesystem::remove_all(directory);
+
+    {
+        ART index{};
+        // a record of an 8 byte key is 22 bytes -> a checkpoint about every 200 inserts
+        ASSERT_TRUE(index.recover(directory, WalConfig{.checkpointBytes = 4096}));
+        for (uint64_t i = 1; i <= 5000; i++) {
+            ASSERT_TRUE(index.insert(Key{i}, i));
+        }
+        index.sync();
+        // the segments before the last checkpoint are gone, the log only holds the inserts after it
+        auto segments = WriteAheadLog::listSegments(directory);
+        ASSERT_EQ(segments.size(), 1);
+        EXPECT_LT(std::filesystem::file_size(WriteAheadLog::segmentPath(directory, segments.front())), 4096);
+    }
+
+    ART index{};
+    ASSERT_TRUE(index.recover(directory));
+    for (uint64_t i = 1; i <= 5000; i++) {
+        EXPECT_EQ(index.lookup(Key{i}), i);
+    }
+
+    std::filesystem::remove_all(directory);
+}
+
+TEST(ART, WalWriteFailure) {
+    auto directory = std::filesystem::temp_directory_path() / ("art_wal_failure_" + std::to_string(getpid()));
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory);
+    // every write to the segment fails with ENOSPC
+    std::filesystem::create_symlink("/dev/full", WriteAheadLog::segmentPath(directory, 7));
+
+    {
+        WriteAheadLog log{directory, 7};
+        log.appendInsert(Key{1}, 1);
+        EXPECT_THROW(log.sync(), std::system_error);
+        // nothing is reported durable after the failure
+        EXPECT_THROW(log.appendInsert(Key{2}, 2), std::system_error);
+        EXPECT_THROW(log.sync(), std::system_error);
+    }
+
+    std::filesystem::remove_all(directory);
+}
+
+TEST(ART, FingerprintTable) {
+    ART index{};
+    // 64 buckets only, so most keys get evicted from the table again and have to be found in the tree
+    index.enableFingerprintTable(4096);
+
+    for (uint64_t i = 1; i <= 10000; i++) {
+        ASSERT_TRUE(index.insert(Key{i * 31}, i));
+    }
+    for (int round = 0; round < 2; round++) {
+        for (uint64_t i = 1; i <= 10000; i++) {
+            EXPECT_EQ(index.lookup(Key{i * 31}), i);
+        }
+    }
+    EXPECT_EQ(index.lookup(Key{30}), INVALID_VALUE);
+
+    FingerprintTable table{4096};
+    EXPECT_EQ(table.memoryUsage(), 4096);
+    LeafNode leaf{Key{42}, 42};
+    table.insert(leaf.key, &leaf);
+    EXPECT_EQ(table.find(Key{42}), &leaf);
+    EXPECT_EQ(table.find(Key{43}), nullptr);
+    table.erase(leaf.key, &leaf);
+    EXPECT_EQ(table.find(Key{42}), nullptr);
+}
+
+static bool keyLess(const Key &a, const Key &b) {
+    auto cmp = std::memcmp(a.key.data(), b.key.data(), std::min(a.key_len, b.key_len));
+    return cmp < 0 || (cmp == 0 && a.key_len < b.key_len);
+}
+
+TEST(KeyEncoding, OrderPreserving) {
+    std::array<int64_t, 6> ints = {INT64_MIN, -1000, -1, 0, 1, INT64_MAX};
+    for (size_t i = 1; i < ints.size(); i++) {
+        EXPECT_TRUE(keyLess(makeKey(ints[i - 1]), makeKey(ints[i])));
+        EXPECT_EQ(KeyReader{makeKey(ints[i])}.readInt64(), ints[i]);
+    }
+
+    std::array<double, 6> doubles = {-INFINITY, -2.5, -0.001, 0.0, 1e-300, 3.5};
+    for (size_t i = 1; i < doubles.size(); i++) {
+        EXPECT_TRUE(keyLess(makeKey(doubles[i - 1]), makeKey(doubles[i])));
+        EXPECT_EQ(KeyReader{makeKey(doubles[i])}.readDouble(), doubles[i]);
+    }
+    EXPECT_EQ(makeKey(-0.0f), makeKey(0.0f));
+
+    // composite keys compare like tuples
+    EXPECT_TRUE(keyLess(makeKey(int32_t{-1}, 7.0f), makeKey(int32_t{0}, -7.0f)));
+    KeyBuilder nullable;
+    nullable.add(std::optional<int32_t>{}).add(std::optional<int32_t>{-3});
+    KeyBuilder withValue;
+    withValue.add(std::optional<int32_t>{-3});
+    EXPECT_TRUE(keyLess(nullable.build(), withValue.build()));
+
+    EXPECT_TRUE(keyLess(makeKey(std::string_view{"ab"}), makeKey(std::string_view{"abc"})));
+    EXPECT_TRUE(keyLess(makeKey(std::string_view{"a"}), makeKey(std::string_view{"a\0", 2})));
+    EXPECT_TRUE(keyLess(makeKey(std::string_view{"a\0", 2}), makeKey(std::string_view{"a\x01"})));
+    auto withZero = makeKey(std::string_view{"a\0b", 3});
+    EXPECT_EQ(KeyReader{withZero}.readString(), std::string("a\0b", 3));
+
+    KeyBuilder tooLong;
+    tooLong.add(int64_t{1}).add(int32_t{2});
+    EXPECT_TRUE(tooLong.overflowed());
+    EXPECT_THROW(tooLong.build(), std::length_error);
+    // truncated, both would be the key of the first column
+    EXPECT_THROW(makeKey(int64_t{1}, int32_t{3}), std::length_error);
+}
+
+TEST(KeyEncoding, BatchAndTree) {
+    std::array<int64_t, 11> values = {-5, 3, INT64_MIN, 0, 99, -99, 1 << 20, INT64_MAX, -7, 12, 13};
+    std::array<Key, 11> keys{};
+    encodeInt64Batch(values.data(), keys.data(), values.size());
+
+    ART index{};
+    for (size_t i = 0; i < values.size(); i++) {
+        ASSERT_EQ(keys[i], makeKey(values[i]));
+        ASSERT_TRUE(index.insert(keys[i], i + 1));
+    }
+    for (size_t i = 0; i < values.size(); i++) {
+        EXPECT_EQ(index.lookup(makeKey(values[i])), i + 1);
+    }
+}
+
+TEST(ART, AsyncLookup) {
+    ART index{};
+    std::vector<Key> keys;
+    for (uint64_t i = 1; i <= 5000; i++) {
+        keys.emplace_back(i * 104729);
+        ASSERT_TRUE(index.insert(keys.back(), i));
+    }
+    keys.emplace_back(uint64_t{3});
+
+    std::vector<Value> values(keys.size());
+    LookupScheduler::lookupBatch(index, keys, values, 8);
+    for (uint64_t i = 0; i < 5000; i++) {
+        EXPECT_EQ(values[i], i + 1);
+    }
+    EXPECT_EQ(values.back(), INVALID_VALUE);
+
+    // awaiting from another coroutine, e.g. a request handler
+    Value sum = 0;
+    auto handler = [&](Key first, Key second) -> LookupTask {
+        sum += co_await index.lookup_async(first);
+        sum += co_await index.lookup_async(second);
+        co_return sum;
+    };
+    auto first = handler(keys[0], keys[1]);
+    auto second = handler(keys[2], keys.back());
+    LookupScheduler::current().schedule(first.coroutine());
+    LookupScheduler::current().schedule(second.coroutine());
+    LookupScheduler::current().run();
+    EXPECT_TRUE(first.done());
+    EXPECT_TRUE(second.done());
+    EXPECT_EQ(sum, 1 + 2 + 3);
+
+    // no lookups in flight is taken as one
+    std::ranges::fill(values, 0);
+    LookupScheduler::lookupBatch(index, keys, values, 0);
+    EXPECT_EQ(values.front(), 1);
+    EXPECT_EQ(values.back(), INVALID_VALUE);
+
+    // a task destroyed while it waits in the queue is not resumed anymore
+    {
+        auto dropped = index.lookup_async(keys[0]);
+        LookupScheduler::current().schedule(dropped.coroutine());
+    }
+    EXPECT_TRUE(LookupScheduler::current().empty());
+    LookupScheduler::current().run();
+}
+
+TEST(ART, AsyncLookupAcrossInsert) {
+    // the lookup suspends on a full root node4, the insert in between grows and frees it
+    ART index{};
+    for (uint64_t i = 1; i <= 4; i++) {
+        ASSERT_TRUE(index.insert(Key{i << 56}, i));
+    }
+    auto lookup = index.lookup_async(Key{uint64_t{2} << 56});
+    lookup.coroutine().resume();
+    ASSERT_FALSE(lookup.done());
+
+    ASSERT_TRUE(index.insert(Key{uint64_t{5} << 56}, 5));
+    ASSERT_EQ(index.get_root()->type, NodeType::N16);
+    LookupScheduler::current().run();
+    ASSERT_TRUE(lookup.done());
+    EXPECT_EQ(lookup.result(), 2);
+}
+
+TEST(ART, LazyExpansion) {
+    ART index{};
+    // a single key is just a leaf, no matter how long its path is
+    ASSERT_TRUE(index.insert(Key{0x0102030405060700}, 1));
+    ASSERT_TRUE(index.get_root()->isLeafNode);
+
+    // the inner node is created where the keys diverge, the shared run becomes its prefix
+    for (uint64_t i = 1; i < 4; i++) {
+        ASSERT_TRUE(index.insert(Key{0x0102030405060700 | i}, i + 1));
+    }
+    auto *root = index.get_root();
+    ASSERT_FALSE(root->isLeafNode);
+    EXPECT_EQ(root->type, NodeType::N4);
+    EXPECT_EQ(root->prefixLength, 7);
+    for (auto *child: dynamic_cast<Node4 *>(root)->children) {
+        EXPECT_TRUE(child->isLeafNode);
+    }
+
+    // diverging inside the prefix splits it
+    ASSERT_TRUE(index.insert(Key{0x0102FF0000000000}, 5));
+    root = index.get_root();
+    EXPECT_EQ(root->prefixLength, 2);
+    for (uint64_t i = 0; i < 4; i++) {
+        EXPECT_EQ(index.lookup(Key{0x0102030405060700 | i}), i + 1);
+    }
+    EXPECT_EQ(index.lookup(Key{0x0102FF0000000000}), 5);
+    EXPECT_EQ(index.lookup(Key{0x0102FF0000000001}), INVALID_VALUE);
+}
+
+TEST(ART, DuplicateAndPrefixKeys) {
+    ART index{};
+    ASSERT_TRUE(index.insert(Key{42}, 1));
+    EXPECT_FALSE(index.insert(Key{42}, 2));
+    EXPECT_EQ(index.lookup(Key{42}), 1);
+
+    ART strings{};
+    ASSERT_TRUE(strings.insert(Key{"abcd", 4}, 1));
+    ASSERT_TRUE(strings.insert(Key{"abxy", 4}, 2));
+    EXPECT_FALSE(strings.insert(Key{"abc", 3}, 3));
+    EXPECT_FALSE(strings.insert(Key{"a", 1}, 4));
+    EXPECT_FALSE(strings.insert(Key{"abcde", 5}, 5));
+    EXPECT_EQ(strings.lookup(Key{"a", 1}), INVALID_VALUE);
+    EXPECT_EQ(strings.lookup(Key{"abc", 3}), INVALID_VALUE);
+    EXPECT_EQ(strings.lookup(Key{"abcd", 4}), 1);
+    EXPECT_EQ(strings.lookup(Key{"abxy", 4}), 2);
+}
+
+TEST(ART, Freeze) {
+    ART index{};
+    EXPECT_EQ(index.freeze().lookup(Key{1}), INVALID_VALUE);
+
+    ASSERT_TRUE(index.insert(Key{7}, 7));
+    EXPECT_EQ(index.freeze().lookup(Key{7}), 7);
+
+    // dense keys give node256s, random ones mostly node4/16/48
+    std::vector<uint64_t> keys;
+    for (uint64_t i = 8; i < 20000; i++) {
+        keys.push_back(i);
+    }
+    std::mt19937_64 random{42};
+    for (int i = 0; i < 20000; i++) {
+        keys.push_back(random() | (uint64_t{1} << 63));
+    }
+    for (auto key: keys) {
+        ASSERT_TRUE(index.insert(Key{key}, key));
+    }
+
+    auto frozen = index.freeze();
+    EXPECT_EQ(frozen.size(), keys.size() + 1);
+    for (auto key: keys) {
+        EXPECT_EQ(frozen.lookup(Key{key}), key);
+    }
+    EXPECT_EQ(frozen.lookup(Key{uint64_t{20000}}), INVALID_VALUE);
+    EXPECT_EQ(frozen.lookup(Key{uint64_t{3}}), INVALID_VALUE);
+
+    std::vector<Value> scanned;
+    frozen.scan(Key{uint64_t{100}}, Key{uint64_t{1099}}, [&](const Key &, Value value) {
+        scanned.push_back(value);
+    });
+    ASSERT_EQ(scanned.size(), 1000);
+    for (uint64_t i = 0; i < 1000; i++) {
+        EXPECT_EQ(scanned[i], 100 + i);
+    }
+
+    uint64_t previous = 0;
+    std::size_t count = 0;
+    frozen.scan(Key{uint64_t{1} << 63}, Key{~uint64_t{0}}, [&](const Key &, Value value) {
+        EXPECT_GT(value, previous);
+        previous = value;
+        count++;
+    });
+    EXPECT_EQ(count, 20000);
+    // the point of freezing: 32 bit words instead of pointers and node headers
+    EXPECT_LT(frozen.memoryUsage(), index.memoryUsage());
+}
+
+TEST(ART, LookupCursor) {
+    ART index{};
+    LookupCursor cursor;
+    EXPECT_EQ(index.lookup(Key{1}, cursor), INVALID_VALUE);
+
+    for (uint64_t i = 1; i <= 100000; i++) {
+        ASSERT_TRUE(index.insert(Key{i}, i));
+    }
+    // sequential probes share all but the last byte or two with their predecessor
+    for (uint64_t i = 1; i <= 100001; i++) {
+        EXPECT_EQ(index.lookup(Key{i}, cursor), i <= 100000 ? i : INVALID_VALUE);
+    }
+    EXPECT_GT(cursor.levelsSkipped, 100000);
+
+    // structural changes invalidate the cached path
+    EXPECT_EQ(index.lookup(Key{uint64_t{1} << 40}, cursor), INVALID_VALUE);
+    ASSERT_TRUE(index.insert(Key{(uint64_t{1} << 40) + 1}, 7));
+    ASSERT_TRUE(index.insert(Key{(uint64_t{1} << 40) + 2}, 8));
+    EXPECT_EQ(index.lookup(Key{(uint64_t{1} << 40) + 1}, cursor), 7);
+    EXPECT_EQ(index.lookup(Key{(uint64_t{1} << 40) + 2}, cursor), 8);
+
+    std::mt19937_64 random{3};
+    for (int i = 0; i < 10000; i++) {
+        auto key = random() % 200000 + 1;
+        EXPECT_EQ(index.lookup(Key{key}, cursor), key <= 100000 ? key : INVALID_VALUE);
+    }
+}
+
+TEST(ART, InsertBatch) {
+    ART index{};
+    // odd keys one by one, even keys in sorted batches -> batches have to merge into existing nodes
+    for (uint64_t i = 1; i <= 20000; i += 2) {
+        ASSERT_TRUE(index.insert(Key{i}, i));
+    }
+    for (uint64_t start = 0; start < 40000; start += 1000) {
+        std::vector<std::pair<Key, Value>> batch;
+        for (uint64_t i = start; i < start + 1000; i += 2) {
+            batch.emplace_back(Key{i + 2}, i + 2);
+        }
+        EXPECT_EQ(index.insert_batch(batch), batch.size());
+    }
+    for (uint64_t i = 1; i <= 20000; i++) {
+        EXPECT_EQ(index.lookup(Key{i}), i);
+    }
+    for (uint64_t i = 20002; i <= 40000; i += 2) {
+        EXPECT_EQ(index.lookup(Key{i}), i);
+    }
+    EXPECT_EQ(index.lookup(Key{uint64_t{20001}}), INVALID_VALUE);
+
+    // duplicates in the batch and with the tree are skipped
+    std::vector<std::pair<Key, Value>> duplicates = {{Key{uint64_t{5}}, 1}, {Key{uint64_t{50001}}, 2},
+                                                     {Key{uint64_t{50001}}, 3}};
+    EXPECT_EQ(index.insert_batch(duplicates), 1);
+    EXPECT_EQ(index.lookup(Key{uint64_t{5}}), 5);
+    EXPECT_EQ(index.lookup(Key{uint64_t{50001}}), 2);
+
+    // a sorted batch into an empty tree creates the nodes in their final size
+    ART sparse{};
+    std::vector<std::pair<Key, Value>> batch;
+    for (uint64_t i = 0; i < 200; i++) {
+        batch.emplace_back(Key{(i << 56) | 0xABCD}, i + 1);
+    }
+    EXPECT_EQ(sparse.insert_batch(batch), 200);
+    EXPECT_EQ(sparse.get_root()->type, NodeType::N256);
+    for (uint64_t i = 0; i < 200; i++) {
+        EXPECT_EQ(sparse.lookup(Key{(i << 56) | 0xABCD}), i + 1);
+    }
+
+    ART strings{};
+    std::vector<std::pair<Key, Value>> words = {{Key{"f0ooo", 5}, 1}, {Key{"fo0oo", 5}, 2}, {Key{"foo0o", 5}, 3},
+                                                {Key{"fooo0", 5}, 4}, {Key{"foooo", 5}, 5}};
+    EXPECT_EQ(strings.insert_batch(words), 5);
+    for (auto const &[key, value]: words) {
+        EXPECT_EQ(strings.lookup(key), value);
+    }
+
+    // a full node4 with a child for byte 0 grows to a node48 in one go, passing a node16 with unused slots
+    ART growing{};
+    for (uint64_t b = 0; b < 4; b++) {
+        ASSERT_TRUE(growing.insert(Key{(b << 56) | 7}, 100 + b));
+    }
+    batch.clear();
+    for (uint64_t b = 10; b < 30; b++) {
+        batch.emplace_back(Key{(b << 56) | 7}, 100 + b);
+    }
+    EXPECT_EQ(growing.insert_batch(batch), 20);
+    EXPECT_EQ(growing.get_root()->type, NodeType::N48);
+    for (uint64_t b = 0; b < 30; b++) {
+        EXPECT_EQ(growing.lookup(Key{(b << 56) | 7}), b < 4 || b >= 10 ? 100 + b : INVALID_VALUE);
+    }
+}
+
+TEST(ART, CacheMode) {
+    ART index{};
+    constexpr std::size_t budget = 256 * 1024;
+    ASSERT_TRUE(index.enableCacheMode(budget));
+    EXPECT_FALSE(index.enableCacheMode(budget));
+
+    // keys 1..100 are hot and looked up after every insert, all others are inserted once and never read
+    for (uint64_t i = 1; i <= 100; i++) {
+        ASSERT_TRUE(index.insert(Key{i}, i));
+    }
+    for (uint64_t i = 101; i <= 50000; i++) {
+        ASSERT_TRUE(index.insert(Key{i * 7919}, i));
+        EXPECT_LE(index.memoryUsage(), budget);
+        EXPECT_EQ(index.lookup(Key{i % 100 + 1}), i % 100 + 1);
+    }
+
+    auto stats = index.cacheStats();
+    EXPECT_GT(stats.evictions, 0);
+    EXPECT_EQ(stats.misses, 0);
+    EXPECT_GE(stats.hits, 49900);
+    EXPECT_LE(stats.memoryUsage, budget);
+
+    // whatever is left is intact and accounted for
+    std::size_t entries = 0;
+    index.forEachEntry([&](const Key &key, Value value) {
+        EXPECT_EQ(index.lookup(key), value);
+        entries++;
+    });
+    EXPECT_EQ(entries, 50000 - stats.evictions);
+    EXPECT_EQ(index.lookup(Key{uint64_t{101 * 7919}}), INVALID_VALUE);
+    EXPECT_EQ(index.cacheStats().misses, 1);
+
+    // the root starts with 256 children, then only keys below its first child come in -> the other children are
+    // evicted and the root shrinks step by step
+    ART shrinking{};
+    ASSERT_TRUE(shrinking.enableCacheMode(sizeof(Node256) + 300 * sizeof(CachedLeafNode)));
+    for (uint64_t i = 0; i < 256; i++) {
+        ASSERT_TRUE(shrinking.insert(Key{i << 56}, i + 1));
+    }
+    EXPECT_EQ(shrinking.get_root()->type, NodeType::N256);
+    EXPECT_EQ(shrinking.cacheStats().evictions, 0);
+    for (uint64_t i = 1; i <= 2000; i++) {
+        ASSERT_TRUE(shrinking.insert(Key{i}, i));
+        EXPECT_LE(shrinking.memoryUsage(), shrinking.cacheStats().budgetBytes);
+    }
+    EXPECT_NE(shrinking.get_root()->type, NodeType::N256);
+    EXPECT_EQ(shrinking.lookup(Key{uint64_t{2000}}), 2000);
+    entries = 0;
+    shrinking.forEachEntry([&](const Key &key, Value value) {
+        EXPECT_EQ(shrinking.lookup(key), value);
+        entries++;
+    });
+    EXPECT_EQ(entries, 256 + 2000 - shrinking.cacheStats().evictions);
+
+    ART tiny{};
+    ASSERT_TRUE(tiny.enableCacheMode(sizeof(Node4) + 2 * sizeof(CachedLeafNode)));
+    ASSERT_TRUE(tiny.insert(Key{"abc", 3}, 1));
+    ASSERT_TRUE(tiny.insert(Key{"abd", 3}, 2));
+    EXPECT_EQ(tiny.get_root()->type, NodeType::N4);
+    EXPECT_EQ(tiny.lookup(Key{"abc", 3}), 1);
+    ASSERT_TRUE(tiny.insert(Key{"abe", 3}, 3));
+    // "abd" was the only key without a hit
+    EXPECT_TRUE(tiny.get_root()->isLeafNode || tiny.get_root()->numberOfChildren == 2);
+    EXPECT_EQ(tiny.lookup(Key{"abd", 3}), INVALID_VALUE);
+    EXPECT_EQ(tiny.cacheStats().evictions, 1);
+}
+
+TEST(ART, MultiVersionScan) {
+    ART index{};
+    ASSERT_TRUE(index.enableVersioning());
+    for (uint64_t i = 1; i <= 1000; i++) {
+        ASSERT_TRUE(index.insert(Key{i}, i));
+    }
+    EXPECT_FALSE(index.enableVersioning());
+
+    auto before = index.snapshot();
+    // new versions for the even keys, new keys after them
+    for (uint64_t i = 2; i <= 1000; i += 2) {
+        ASSERT_TRUE(index.insert(Key{i}, i + 100000));
+    }
+    for (uint64_t i = 1001; i <= 1100; i++) {
+        ASSERT_TRUE(index.insert(Key{i}, i + 100000));
+    }
+    EXPECT_EQ(index.lookup(Key{uint64_t{2}}), 100002);
+    EXPECT_EQ(index.lookup(Key{uint64_t{3}}), 3);
+
+    auto collect = [&](const Snapshot &snapshot, uint64_t from, uint64_t to) {
+        std::vector<std::pair<uint64_t, Value>> entries;
+        index.scan(Key{from}, Key{to}, snapshot, [&](const Key &key, Value value) {
+            uint64_t k;
+            std::memcpy(&k, key.key.data(), sizeof(k));
+            entries.emplace_back(__builtin_bswap64(k), value);
+            return true;
+        });
+        return entries;
+    };
+
+    auto old = collect(before, 0, UINT64_MAX);
+    ASSERT_EQ(old.size(), 1000);
+    for (uint64_t i = 1; i <= 1000; i++) {
+        EXPECT_EQ(old[i - 1], std::make_pair(i, i));
+    }
+    {
+        auto after = index.snapshot();
+        auto current = collect(after, 0, UINT64_MAX);
+        ASSERT_EQ(current.size(), 1100);
+        for (uint64_t i = 1; i <= 1100; i++) {
+            EXPECT_EQ(current[i - 1], std::make_pair(i, i % 2 == 0 || i > 1000 ? i + 100000 : i));
+        }
+        EXPECT_EQ(collect(after, 100, 200).size(), 101);
+        EXPECT_EQ(collect(after, 1050, 5000).size(), 51);
+    }
+
+    // stopping early
+    std::size_t visited = 0;
+    index.scan(Key{uint64_t{1}}, Key{uint64_t{1000}}, before, [&](const Key &, Value) { return ++visited < 5; });
+    EXPECT_EQ(visited, 5);
+
+    // the old versions stay as long as `before` may see them
+    EXPECT_EQ(index.collectGarbage(), 0);
+    {
+        auto moved = std::move(before);
+        EXPECT_EQ(collect(moved, 0, UINT64_MAX).size(), 1000);
+    }
+    auto memory = index.memoryUsage();
+    EXPECT_EQ(index.collectGarbage(), 500);
+    EXPECT_EQ(index.memoryUsage(), memory - 500 * sizeof(VersionedLeafNode));
+    EXPECT_EQ(index.collectGarbage(), 0);
+    EXPECT_EQ(collect(index.snapshot(), 0, UINT64_MAX).size(), 1100);
+
+    // random keys give all node types, variable length keys check the range bounds on the inner levels
+    ART random{};
+    std::mt19937_64 generator{7};
+    std::vector<uint64_t> keys;
+    for (int i = 0; i < 20000; i++) {
+        keys.push_back(generator() >> (generator() % 40));
+        random.insert(Key{keys.back()}, keys.back());
+    }
+    std::ranges::sort(keys);
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    std::vector<uint64_t> scanned;
+    random.scan(Key{uint64_t{0}}, Key{UINT64_MAX}, random.snapshot(), [&](const Key &, Value value) {
+        scanned.push_back(value);
+        return true;
+    });
+    EXPECT_EQ(scanned, keys);
+
+    ART strings{};
+    std::array<const char *, 6> const words{"abc", "abdxy", "abe", "b", "cde12", "ab0"};
+    for (std::size_t i = 0; i < words.size(); i++) {
+        ASSERT_TRUE(strings.insert(Key{words[i], static_cast<uint8_t>(std::strlen(words[i]))}, i + 1));
+    }
+    std::string seen;
+    strings.scan(Key{"abd", 3}, Key{"b", 1}, strings.snapshot(), [&](const Key &key, Value) {
+        seen.append(reinterpret_cast<const char *>(key.key.data()), key.key_len).push_back(' ');
+        return true;
+    });
+    EXPECT_EQ(seen, "abdxy abe b ");
+}
+
+TEST(CompactART, SameAsART) {
+    ART reference{};
+    CompactART compact{};
+    std::mt19937_64 generator{11};
+    std::vector<uint64_t> keys;
+    for (int i = 0; i < 200000; i++) {
+        // mixes dense and sparse regions, so all node types show up
+        keys.push_back(generator() >> (generator() % 48));
+        EXPECT_EQ(compact.insert(Key{keys.back()}, keys.back() | 1), reference.insert(Key{keys.back()}, keys.back() | 1));
+    }
+    for (auto key: keys) {
+        EXPECT_EQ(compact.lookup(Key{key}), reference.lookup(Key{key}));
+        EXPECT_EQ(compact.lookup(Key{key + 1}), reference.lookup(Key{key + 1}));
+    }
+    std::size_t entries = 0;
+    compact.forEachEntry([&](const Key &key, Value value) {
+        EXPECT_EQ(reference.lookup(key), value);
+        entries++;
+    });
+    EXPECT_EQ(entries, compact.size());
+
+    // the inner nodes take about half the space, even with the pools not filled up completely
+    auto const referenceInner = reference.memoryUsage() - compact.size() * sizeof(LeafNode);
+    EXPECT_LT(compact.innerMemoryUsage(), referenceInner * 6 / 10);
+    // a leaf record is half a plain LeafNode, the last block of the pool is not full yet
+    EXPECT_LE(compact.leafMemoryUsage(), compact.size() * sizeof(LeafNode) / 2 + 65536);
+
+    CompactART strings{};
+    EXPECT_TRUE(strings.insert(Key{"abc", 3}, 1));
+    EXPECT_TRUE(strings.insert(Key{"abd", 3}, 2));
+    EXPECT_FALSE(strings.insert(Key{"ab", 2}, 3));
+    EXPECT_FALSE(strings.insert(Key{"abcd", 4}, 4));
+    EXPECT_FALSE(strings.insert(Key{"abc", 3}, 5));
+    EXPECT_TRUE(strings.insert(Key{"b", 1}, 6));
+    EXPECT_EQ(strings.lookup(Key{"abc", 3}), 1);
+    EXPECT_EQ(strings.lookup(Key{"abd", 3}), 2);
+    EXPECT_EQ(strings.lookup(Key{"b", 1}), 6);
+    EXPECT_EQ(strings.lookup(Key{"ab", 2}), INVALID_VALUE);
+    EXPECT_EQ(CompactART::tagOf(strings.getRoot()), CompactART::Tag::N4);
+}
+
+TEST(ART, Profiler) {
+    ART index{};
+    index.enableProfiling(10);
+    for (uint64_t i = 1; i <= 10000; i++) {
+        ASSERT_TRUE(index.insert(Key{i * 7919}, i));
+    }
+    for (uint64_t i = 1; i <= 10000; i++) {
+        ASSERT_EQ(index.lookup(Key{i * 7919}), i);
+    }
+
+    auto const *profiler = index.getProfiler();
+    ASSERT_NE(profiler, nullptr);
+    auto report = profiler->report();
+    EXPECT_NE(report.find("2000 sampled operations"), std::string::npos) << report;
+    EXPECT_NE(report.find("lookup"), std::string::npos);
+    EXPECT_NE(report.find("leaf"), std::string::npos);
+
+    // every sampled lookup ends at a leaf, so the folded stacks of lookups contain one
+    std::ostringstream folded;
+    profiler->writeFolded(folded, Profiler::Event::Nanoseconds);
+    std::istringstream lines{folded.str()};
+    std::size_t lookupStacks = 0;
+    for (std::string line; std::getline(lines, line);) {
+        EXPECT_TRUE(line.starts_with("lookup;L0 ") || line.starts_with("insert;L0 ")) << line;
+        lookupStacks += line.starts_with("lookup;") && line.find(" leaf ") != std::string::npos;
+    }
+    EXPECT_GT(lookupStacks, 0);
+
+    // without perf_event_open only the time is reported, nothing else changes
+    std::ostringstream misses;
+    profiler->writeFolded(misses, Profiler::Event::LlcMisses);
+    if (!Profiler::hardwareCountersAvailable()) {
+        EXPECT_TRUE(misses.str().empty());
+    }
+}
+
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
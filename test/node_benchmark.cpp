@@ -0,0 +1,104 @@
+#include "art.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <vector>
+
+// Micro-benchmark of the child lookup of each node type. Every node is probed with random key bytes, so the hit rate
+// is numberOfChildren / 256 and the branch predictor cannot learn the outcome. Not a test, run it by hand:
+//   ./node_benchmark [probes]
+
+using Clock = std::chrono::steady_clock;
+
+/** the Node4 lookup before the SWAR version: early exit loop over all four keys */
+static Node **findChildLoop(Node4 &node, uint8_t partOfKey) {
+    for (uint8_t i = 0; i < node.keys.size(); i++) {
+        if (node.keys[i] == partOfKey) {
+            return &node.children[i];
+        }
+    }
+    return nullptr;
+}
+
+template<typename Lookup>
+static void measure(const char *name, uint16_t children, const std::vector<uint8_t> &probes, Lookup lookup) {
+    // the children are never dereferenced, so any non-null address works
+    uintptr_t checksum = 0;
+    auto begin = Clock::now();
+    for (auto partOfKey: probes) {
+        checksum += reinterpret_cast<uintptr_t>(lookup(partOfKey));
+    }
+    auto seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+    std::cout << std::setw(14) << name << std::setw(10) << children << std::setw(12) << std::fixed
+              << std::setprecision(2) << seconds * 1e9 / probes.size() << "   (checksum " << checksum % 1000 << ")\n";
+}
+
+template<typename NodeType>
+static NodeType makeNode(uint16_t children, std::mt19937 &random) {
+    NodeType node{};
+    std::vector<uint16_t> bytes(256);
+    for (uint16_t i = 0; i < 256; i++) {
+        bytes[i] = i;
+    }
+    std::shuffle(bytes.begin(), bytes.end(), random);
+    for (uint16_t i = 0; i < children; i++) {
+        node.addChildren(static_cast<uint8_t>(bytes[i]), reinterpret_cast<Node *>(uintptr_t{0x1000} + 8 * i));
+    }
+    return node;
+}
+
+int main(int argc, char **argv) {
+    std::size_t const numberOfProbes = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 50'000'000;
+    std::mt19937 random{42};
+    std::vector<uint8_t> probes(numberOfProbes);
+    for (auto &probe: probes) {
+        probe = static_cast<uint8_t>(random());
+    }
+
+    std::cout << std::setw(14) << "node" << std::setw(10) << "children" << std::setw(12) << "ns/probe" << '\n';
+
+    for (uint16_t children: {2, 4}) {
+        auto node = makeNode<Node4>(children, random);
+        measure("Node4 loop", children, probes, [&](uint8_t partOfKey) { return findChildLoop(node, partOfKey); });
+        measure("Node4 SWAR", children, probes, [&](uint8_t partOfKey) { return node.findChild(partOfKey); });
+    }
+    for (uint16_t children: {5, 16}) {
+        auto node = makeNode<Node16>(children, random);
+        measure("Node16", children, probes, [&](uint8_t partOfKey) { return node.findChild(partOfKey); });
+    }
+    for (uint16_t children: {17, 48}) {
+        auto node = makeNode<Node48>(children, random);
+        measure("Node48", children, probes, [&](uint8_t partOfKey) { return node.findChild(partOfKey); });
+    }
+    for (uint16_t children: {49, 256}) {
+        auto node = makeNode<Node256>(children, random);
+        measure("Node256", children, probes, [&](uint8_t partOfKey) { return node.findChild(partOfKey); });
+    }
+
+    // whole tree: dense keys give node256s, sparse keys mostly node4s, every lookup walks through all inner levels
+    for (auto [name, stride]: {std::pair{"dense", uint64_t{1}}, std::pair{"sparse", uint64_t{0x0101010101}}}) {
+        ART tree;
+        constexpr uint64_t numberOfKeys = 1'000'000;
+        for (uint64_t i = 0; i < numberOfKeys; i++) {
+            tree.insert(Key{i * stride}, i + 1);
+        }
+        std::vector<Key> keys;
+        keys.reserve(numberOfProbes / 10);
+        for (std::size_t i = 0; i < numberOfProbes / 10; i++) {
+            keys.emplace_back(uint64_t{random() % numberOfKeys} * stride);
+        }
+        Value sum = 0;
+        auto begin = Clock::now();
+        for (auto const &key: keys) {
+            sum += tree.lookup(key);
+        }
+        auto seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+        std::cout << std::setw(14) << "ART " << name << std::setw(10) << numberOfKeys << std::setw(12)
+                  << seconds * 1e9 / keys.size() << "   (checksum " << sum % 1000 << ")\n";
+    }
+    return 0;
+}
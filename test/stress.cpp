@@ -0,0 +1,426 @@
+#include "gtest/gtest.h"
+
+#include "art.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Multi-threaded driver for mixed insert/lookup workloads. Every operation is recorded with its invocation and response
+// time, the merged history is then checked for linearizability.
+
+using Clock = std::chrono::steady_clock;
+
+struct Operation {
+    enum class Kind : uint8_t {
+        Insert, Lookup
+    };
+
+    Kind kind;
+    uint64_t key;
+    // inserted value or the value the lookup returned
+    Value value;
+    int64_t invoke;
+    int64_t response;
+};
+
+using History = std::vector<Operation>;
+
+static int64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+/**
+ * The ART is a map where every key is inserted at most once, so it is a set of independent write-once registers and it
+ * is enough to check each key on its own (linearizability is compositional). For one key with insert I of value v:
+ *  - a lookup must return either v or INVALID_VALUE
+ *  - a lookup returning v must not end before I started
+ *  - a lookup returning INVALID_VALUE must start before I ended and before any lookup that returned v ended
+ * Returns a description of the first violation or an empty string.
+ */
+static std::string checkLinearizable(const History &history) {
+    struct KeyHistory {
+        const Operation *insert = nullptr;
+        std::vector<const Operation *> lookups;
+    };
+    std::unordered_map<uint64_t, KeyHistory> perKey;
+    for (auto const &operation: history) {
+        auto &keyHistory = perKey[operation.key];
+        if (operation.kind == Operation::Kind::Insert) {
+            if (keyHistory.insert != nullptr) {
+                return "key " + std::to_string(operation.key) + " was inserted twice";
+            }
+            keyHistory.insert = &operation;
+        } else {
+            keyHistory.lookups.push_back(&operation);
+        }
+    }
+
+    for (auto const &[key, keyHistory]: perKey) {
+        auto const *insert = keyHistory.insert;
+        // the point in time by which the key must be visible to everyone
+        int64_t visibleBy = insert != nullptr ? insert->response : INT64_MAX;
+        for (auto const *lookup: keyHistory.lookups) {
+            if (lookup->value == INVALID_VALUE) {
+                continue;
+            }
+            if (insert == nullptr || lookup->value != insert->value) {
+                return "lookup of key " + std::to_string(key) + " returned a value that was never inserted";
+            }
+            if (lookup->response < insert->invoke) {
+                return "lookup of key " + std::to_string(key) + " saw the insert before it started";
+            }
+            visibleBy = std::min(visibleBy, lookup->response);
+        }
+        for (auto const *lookup: keyHistory.lookups) {
+            if (lookup->value == INVALID_VALUE && lookup->invoke > visibleBy) {
+                return "lookup of key " + std::to_string(key) + " missed a value that was already visible";
+            }
+        }
+    }
+    return "";
+}
+
+/** The only concurrent mode for now: one reader-writer lock around the whole tree. */
+class LockedART {
+public:
+    bool insert(const Key &key, Value value) {
+        std::unique_lock lock{mutex};
+        return tree.insert(key, value);
+    }
+
+    Value lookup(const Key &key) {
+        std::shared_lock lock{mutex};
+        return tree.lookup(key);
+    }
+
+private:
+    std::shared_mutex mutex;
+    ART tree;
+};
+
+struct WorkloadResult {
+    History history;
+    double seconds;
+    std::size_t operations;
+};
+
+/**
+ * Runs `operationsPerThread` operations on each of `threads` threads. Thread t inserts keys t, t + threads, ... (so
+ * every key is inserted once), lookups pick random keys from the whole key range, including ones not inserted yet.
+ */
+template<typename Index>
+WorkloadResult runWorkload(Index &index, unsigned threads, std::size_t operationsPerThread, double insertRatio,
+                           bool recordHistory) {
+    std::vector<History> histories(threads);
+    std::atomic<unsigned> ready{0};
+    std::atomic<bool> start{false};
+    auto const keyRange = threads * operationsPerThread;
+
+    auto worker = [&](unsigned thread) {
+        std::mt19937_64 random{thread * 7919 + 1};
+        std::uniform_real_distribution<double> choice{0.0, 1.0};
+        std::uniform_int_distribution<uint64_t> anyKey{0, keyRange};
+        uint64_t nextInsert = thread;
+        auto &history = histories[thread];
+        if (recordHistory) {
+            history.reserve(operationsPerThread);
+        }
+
+        ready++;
+        while (!start.load()) {
+            std::this_thread::yield();
+        }
+
+        for (std::size_t i = 0; i < operationsPerThread; i++) {
+            Operation operation{};
+            if (choice(random) < insertRatio) {
+                operation.kind = Operation::Kind::Insert;
+                operation.key = nextInsert + 1;
+                operation.value = operation.key;
+                nextInsert += threads;
+                operation.invoke = recordHistory ? now() : 0;
+                index.insert(Key{operation.key}, operation.value);
+            } else {
+                operation.kind = Operation::Kind::Lookup;
+                operation.key = anyKey(random) + 1;
+                operation.invoke = recordHistory ? now() : 0;
+                operation.value = index.lookup(Key{operation.key});
+            }
+            if (recordHistory) {
+                operation.response = now();
+                history.push_back(operation);
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned thread = 0; thread < threads; thread++) {
+        workers.emplace_back(worker, thread);
+    }
+    while (ready.load() < threads) {
+        std::this_thread::yield();
+    }
+    auto begin = Clock::now();
+    start = true;
+    for (auto &thread: workers) {
+        thread.join();
+    }
+    auto seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+
+    WorkloadResult result{{}, seconds, threads * operationsPerThread};
+    for (auto &history: histories) {
+        result.history.insert(result.history.end(), history.begin(), history.end());
+    }
+    return result;
+}
+
+static unsigned maxThreads() {
+    if (auto *configured = std::getenv("ART_STRESS_THREADS")) {
+        return std::max(1, std::atoi(configured));
+    }
+    return std::max(2u, std::thread::hardware_concurrency());
+}
+
+TEST(Stress, CheckerDetectsViolations) {
+    using Kind = Operation::Kind;
+    // lookup sees the value although it finished before the insert started
+    EXPECT_FALSE(checkLinearizable({{Kind::Lookup, 1, 1, 0, 1}, {Kind::Insert, 1, 1, 2, 3}}).empty());
+    // lookup misses the value although it started after the insert ended
+    EXPECT_FALSE(checkLinearizable({{Kind::Insert, 1, 1, 0, 1}, {Kind::Lookup, 1, INVALID_VALUE, 2, 3}}).empty());
+    // second lookup misses the value although an earlier one already saw it
+    EXPECT_FALSE(checkLinearizable({{Kind::Insert, 1, 1, 0, 10}, {Kind::Lookup, 1, 1, 1, 2},
+                                    {Kind::Lookup, 1, INVALID_VALUE, 3, 4}}).empty());
+    // wrong value
+    EXPECT_FALSE(checkLinearizable({{Kind::Insert, 1, 1, 0, 1}, {Kind::Lookup, 1, 2, 2, 3}}).empty());
+
+    // overlapping operations may go either way
+    EXPECT_TRUE(checkLinearizable({{Kind::Insert, 1, 1, 0, 10}, {Kind::Lookup, 1, INVALID_VALUE, 5, 6},
+                                   {Kind::Lookup, 1, 1, 7, 8}, {Kind::Lookup, 2, INVALID_VALUE, 0, 1}}).empty());
+}
+
+TEST(Stress, LockedTreeIsLinearizable) {
+    for (unsigned threads: {1u, 2u, maxThreads()}) {
+        LockedART index;
+        auto result = runWorkload(index, threads, 50000, 0.5, true);
+        auto violation = checkLinearizable(result.history);
+        EXPECT_TRUE(violation.empty()) << threads << " threads: " << violation;
+    }
+}
+
+TEST(Stress, ConcurrentReaders) {
+    // lookups without any lock are fine as long as nobody writes
+    ART index;
+    constexpr uint64_t numberOfKeys = 100000;
+    for (uint64_t key = 1; key <= numberOfKeys; key++) {
+        ASSERT_TRUE(index.insert(Key{key}, key));
+    }
+
+    std::atomic<uint64_t> errors{0};
+    std::vector<std::thread> readers;
+    for (unsigned thread = 0; thread < maxThreads(); thread++) {
+        readers.emplace_back([&, thread] {
+            std::mt19937_64 random{thread};
+            for (int i = 0; i < 100000; i++) {
+                auto key = random() % numberOfKeys + 1;
+                errors += index.lookup(Key{key}) != key;
+            }
+        });
+    }
+    for (auto &reader: readers) {
+        reader.join();
+    }
+    EXPECT_EQ(errors.load(), 0);
+}
+
+TEST(Stress, FingerprintTableUnderSharedLock) {
+    // lookups that miss the table fill it, readers under the shared lock do that concurrently with each other while
+    // the writer inserts under the exclusive lock. A tiny table makes fills overwrite each other all the time.
+    constexpr uint64_t numberOfKeys = 20000;
+    std::shared_mutex mutex;
+    ART index;
+    index.enableFingerprintTable(1024);
+    for (uint64_t key = 1; key <= numberOfKeys; key++) {
+        ASSERT_TRUE(index.insert(Key{key}, key));
+    }
+
+    std::thread writer([&] {
+        for (uint64_t key = numberOfKeys + 1; key <= numberOfKeys + 5000; key++) {
+            std::unique_lock lock{mutex};
+            index.insert(Key{key}, key);
+        }
+    });
+
+    // a fixed number of lookups per reader, the shared_mutex may prefer readers and starve the writer otherwise
+    std::atomic<uint64_t> errors{0};
+    std::vector<std::thread> readers;
+    for (unsigned thread = 0; thread < std::max(4u, maxThreads()); thread++) {
+        readers.emplace_back([&, thread] {
+            std::mt19937_64 random{thread};
+            for (int i = 0; i < 50000; i++) {
+                auto key = random() % numberOfKeys + 1;
+                std::shared_lock lock{mutex};
+                errors += index.lookup(Key{key}) != key;
+            }
+        });
+    }
+    writer.join();
+    for (auto &reader: readers) {
+        reader.join();
+    }
+    EXPECT_EQ(errors.load(), 0);
+}
+
+TEST(Stress, FingerprintTableFreedLeaves) {
+    // racing fills may cache a leaf in more than one slot. Freeing a leaf has to drop all of them, otherwise a later
+    // probe reads the freed leaf (caught by ASan, or as a wrong value). Leaves are freed by the garbage collector of a
+    // versioned tree and by the evictions of a cache.
+    constexpr uint64_t numberOfKeys = 2000;
+    constexpr Value round = 1000000;
+    for (bool cacheMode: {false, true}) {
+        std::shared_mutex mutex;
+        ART index;
+        if (cacheMode) {
+            ASSERT_TRUE(index.enableCacheMode(numberOfKeys * sizeof(CachedLeafNode)));
+        } else {
+            ASSERT_TRUE(index.enableVersioning());
+        }
+        index.enableFingerprintTable(1024);
+        for (uint64_t key = 1; key <= numberOfKeys; key++) {
+            ASSERT_TRUE(index.insert(Key{key}, key));
+        }
+
+        std::thread writer([&] {
+            for (Value r = 1; r <= 20; r++) {
+                // new versions of all keys, or new keys that evict the old ones
+                for (uint64_t key = 1; key <= numberOfKeys; key += 7) {
+                    std::unique_lock lock{mutex};
+                    index.insert(Key{cacheMode ? r * round + key : key}, r * round + key);
+                }
+                std::unique_lock lock{mutex};
+                index.collectGarbage();
+            }
+        });
+
+        std::atomic<uint64_t> errors{0};
+        std::vector<std::thread> readers;
+        for (unsigned thread = 0; thread < std::max(4u, maxThreads()); thread++) {
+            readers.emplace_back([&, thread] {
+                std::mt19937_64 random{thread};
+                for (int i = 0; i < 20000; i++) {
+                    auto key = random() % numberOfKeys + 1;
+                    std::shared_lock lock{mutex};
+                    auto value = index.lookup(Key{key});
+                    errors += value != INVALID_VALUE && value % round != key;
+                }
+            });
+        }
+        writer.join();
+        for (auto &reader: readers) {
+            reader.join();
+        }
+        EXPECT_EQ(errors.load(), 0);
+    }
+}
+
+// a benchmark rather than a test, it takes minutes on a big machine. Run it by hand:
+//   ./stress_test --gtest_also_run_disabled_tests --gtest_filter=Stress.DISABLED_ThroughputScaling
+TEST(Stress, DISABLED_ThroughputScaling) {
+    constexpr std::size_t operationsPerThread = 200000;
+    std::cout << "mixed workload, 50% inserts, " << operationsPerThread << " operations per thread\n";
+    std::cout << std::setw(8) << "threads" << std::setw(14) << "Mops/s" << std::setw(10) << "speedup" << '\n';
+
+    double singleThreaded = 0;
+    for (unsigned threads = 1; threads <= maxThreads(); threads++) {
+        LockedART index;
+        auto result = runWorkload(index, threads, operationsPerThread, 0.5, false);
+        auto throughput = result.operations / result.seconds / 1e6;
+        if (threads == 1) {
+            singleThreaded = throughput;
+        }
+        std::cout << std::setw(8) << threads << std::setw(14) << std::fixed << std::setprecision(3) << throughput
+                  << std::setw(10) << std::setprecision(2) << throughput / singleThreaded << '\n';
+    }
+}
+
+TEST(Stress, SnapshotScansAreConsistent) {
+    // the writer sets all keys to the round number, key by key. Scans take the shared lock only for short chunks, so
+    // without snapshots a scan would see later rounds for later keys. With a snapshot every scan has to see a state
+    // between two inserts: a run of keys at round r followed by the rest at round r - 1.
+    constexpr uint64_t numberOfKeys = 5000;
+    constexpr std::size_t chunk = 64;
+    std::shared_mutex mutex;
+    ART index;
+    ASSERT_TRUE(index.enableVersioning());
+    for (uint64_t key = 1; key <= numberOfKeys; key++) {
+        ASSERT_TRUE(index.insert(Key{key}, 0));
+    }
+
+    std::atomic<bool> done{false};
+    std::thread writer([&] {
+        for (Value round = 1; round <= 40; round++) {
+            for (uint64_t key = 1; key <= numberOfKeys; key++) {
+                std::unique_lock lock{mutex};
+                index.insert(Key{key}, round);
+            }
+            std::unique_lock lock{mutex};
+            index.collectGarbage();
+        }
+        done = true;
+    });
+
+    std::atomic<uint64_t> scans{0};
+    std::atomic<uint64_t> violations{0};
+    std::vector<std::thread> readers;
+    for (unsigned thread = 0; thread < std::max(1u, maxThreads() - 1); thread++) {
+        readers.emplace_back([&] {
+            while (!done.load()) {
+                auto snapshot = index.snapshot();
+                std::vector<Value> values;
+                Key from{uint64_t{1}};
+                bool finished = false;
+                while (!finished) {
+                    std::shared_lock lock{mutex};
+                    std::size_t visited = 0;
+                    finished = true;
+                    index.scan(from, Key{numberOfKeys}, snapshot, [&](const Key &key, Value value) {
+                        if (visited == chunk) {
+                            // continue with this key after releasing the lock for a moment
+                            from = key;
+                            finished = false;
+                            return false;
+                        }
+                        values.push_back(value);
+                        visited++;
+                        return true;
+                    });
+                }
+                bool consistent = values.size() == numberOfKeys;
+                for (std::size_t i = 1; consistent && i < values.size(); i++) {
+                    consistent = values[i] <= values[i - 1] && values[0] - values[i] <= 1;
+                }
+                violations += !consistent;
+                scans++;
+            }
+        });
+    }
+    writer.join();
+    for (auto &reader: readers) {
+        reader.join();
+    }
+    EXPECT_GT(scans.load(), 0);
+    EXPECT_EQ(violations.load(), 0);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}